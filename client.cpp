@@ -6,24 +6,347 @@
 #include <arpa/inet.h>
 #include <gio/gio.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <thread>
+#include <vector>
+#include "jitterbuffer.h"
+#include "latency.h"
+#include "protocol.h"
 
 /**
- * Playback pipeline description: udpsrc name=udpsrc caps="application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264, payload=(int)96" ! rtph264depay ! avdec_h264 ! videoconvert ! autovideosink
+ * Composite video reception statistics, gathered by the playback pipeline and reported to the server.
  */
-GstElement *playback_pipeline_make(GSocket *socket)
+struct reception_stats
+{
+    std::mutex mutex;
+    bool has_packet = false;
+    uint32_t ssrc;
+    uint16_t last_seq;
+    // Extended highest sequence number, and its value at the previous report
+    int64_t highest_seq;
+    int64_t report_seq;
+    // Packets and bytes received since the previous report
+    uint32_t packets = 0;
+    uint64_t bytes = 0;
+    // Relative transit time of the previous packet and interarrival jitter (RFC 3550), in RTP timestamp units
+    int32_t transit_prev;
+    double jitter = 0;
+    gint64 report_time = 0;
+};
+
+reception_stats playback_stats;
+
+// Playback jitter buffers whose playout delay is adapted, in adaptive mode
+std::vector<GstElement *> adaptive_jitterbuffers;
+std::mutex adaptive_jitterbuffers_mutex;
+// Frame rate of the played video, as configured by the server, which sets the margin of the adapted playout delay
+std::atomic<int> playback_framerate{30};
+
+// Capture pipeline encoder, nullptr in receive-only mode, for handling keyframe requests from the streaming thread of the playback pipeline
+std::atomic<GstElement *> capture_x264enc{nullptr};
+
+// Capture pipeline udpsink, nullptr in receive-only mode, whose pacing rate follows the encoder bitrate
+std::atomic<GstElement *> capture_udpsink{nullptr};
+
+// Pacing rate of the sent video, as a multiple of its bitrate, 0 for no pacing
+double pacing_multiple = 0;
+
+// Encoder bitrate per pixel of each frame, in bits: 500 kbit/s at 320x240 and 30 fps
+const double CAPTURE_BITS_PER_PIXEL = 500000.0 / (320 * 240 * 30);
+
+// Capture pipeline capsfilter before the encoder, whose size follows the cell messages from the server, nullptr in receive-only mode
+std::atomic<GstElement *> capture_capsfilter{nullptr};
+
+// SSRC of the sent video, for telling the own source apart in latency statistics
+std::atomic<uint32_t> capture_ssrc{0};
+
+/**
+ * End-to-end latency of the frames of a source, from capture to display, since the previous report.
+ */
+struct source_latency
+{
+    gint64 sum = 0;
+    gint64 max = 0;
+    uint32_t count = 0;
+};
+
+std::map<uint32_t, source_latency> latency_stats;
+std::mutex latency_stats_mutex;
+
+// Timing of the composite frames received, in composite mode
+frame_timings playback_timings;
+
+/**
+ * Sets the encoder bitrate after the size and frame rate of the encoded video, and the pacing rate of the udpsink along.
+ */
+void capture_bitrate_set(GstElement *x264enc, GstElement *udpsink, int width, int height, int framerate)
+{
+    // x264enc bitrate, in kbit/s
+    int bitrate = std::max(50, (int)(CAPTURE_BITS_PER_PIXEL * width * height * framerate / 1000));
+    g_object_set(x264enc, "bitrate", bitrate, nullptr);
+    // max-bitrate: Spreads the packets of large frames (keyframes) over time, at a multiple of the encoder bitrate, in bit/s
+    if (pacing_multiple > 0)
+    {
+        g_object_set(udpsink, "max-bitrate", (guint64)(pacing_multiple * bitrate * 1000), nullptr);
+    }
+}
+
+/**
+ * Handles a control message from the server.
+ */
+void control_message_handle(const char *data, size_t len)
+{
+    if (control_message_type(data) == CONTROL_KEYFRAME)
+    {
+        GstElement *x264enc = capture_x264enc.load();
+        if (x264enc == nullptr)
+            return;
+        GstPad *x264enc_src_pad = gst_element_get_static_pad(x264enc, "src");
+        gst_pad_send_event(x264enc_src_pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, true, 0));
+        gst_object_unref(x264enc_src_pad);
+    }
+    else if (control_message_type(data) == CONTROL_CELL)
+    {
+        GstElement *capsfilter = capture_capsfilter.load();
+        uint16_t width;
+        uint16_t height;
+        if (capsfilter == nullptr || !control_cell_parse(data, len, width, height))
+            return;
+        GstCaps *caps;
+        g_object_get(capsfilter, "caps", &caps, nullptr);
+        gint current_width = 0;
+        gint current_height = 0;
+        gint framerate_num = 30;
+        gint framerate_denom = 1;
+        GstStructure *structure = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(structure, "width", &current_width);
+        gst_structure_get_int(structure, "height", &current_height);
+        gst_structure_get_fraction(structure, "framerate", &framerate_num, &framerate_denom);
+        // The cell size is repeated in reply to every join message, while changing caps restarts the encoder
+        if (current_width != width || current_height != height)
+        {
+            caps = gst_caps_make_writable(caps);
+            gst_caps_set_simple(caps, "width", G_TYPE_INT, (gint)width, "height", G_TYPE_INT, (gint)height, nullptr);
+            g_object_set(capsfilter, "caps", caps, nullptr);
+            GstElement *x264enc = capture_x264enc.load();
+            GstElement *udpsink = capture_udpsink.load();
+            if (x264enc && udpsink)
+            {
+                capture_bitrate_set(x264enc, udpsink, width, height, framerate_num / std::max(1, framerate_denom));
+            }
+            std::cout << "Capture: encoding at " << width << "x" << height << ", the cell size of the composite." << std::endl;
+        }
+        gst_caps_unref(caps);
+    }
+}
+
+/**
+ * Updates the reception statistics given as user_data, if any, with each RTP packet received by the playback pipeline. Control messages from the server arrive on the same socket; they are handled and dropped.
+ */
+GstPadProbeReturn playback_udpsrc_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto stats_ptr = (reception_stats *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+
+    if (control_message_is((const char *)map.data, map.size))
+    {
+        control_message_handle((const char *)map.data, map.size);
+        gst_buffer_unmap(buffer, &map);
+        return GST_PAD_PROBE_DROP;
+    }
+
+    // RTP version 2 header
+    if (stats_ptr && map.size >= 12 && (map.data[0] >> 6) == 2)
+    {
+        uint16_t seq = (map.data[2] << 8) | map.data[3];
+        uint32_t timestamp = ((uint32_t)map.data[4] << 24) | (map.data[5] << 16) | (map.data[6] << 8) | map.data[7];
+        uint32_t ssrc = ((uint32_t)map.data[8] << 24) | (map.data[9] << 16) | (map.data[10] << 8) | map.data[11];
+        // Arrival time in 90 kHz RTP timestamp units
+        uint32_t arrival = (uint32_t)(g_get_monotonic_time() * 9 / 100);
+        int32_t transit = (int32_t)(arrival - timestamp);
+
+        auto &stats = *stats_ptr;
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        int16_t seq_diff = (int16_t)(seq - stats.last_seq);
+
+        // Stream start, or restart, e.g. when the server moves the client to another rendition
+        if (!stats.has_packet || ssrc != stats.ssrc || std::abs(seq_diff) > 1000)
+        {
+            stats.has_packet = true;
+            stats.ssrc = ssrc;
+            stats.last_seq = seq;
+            stats.highest_seq = seq;
+            stats.report_seq = seq - 1;
+            stats.packets = 0;
+            stats.transit_prev = transit;
+        }
+        else if (seq_diff > 0)
+        {
+            stats.last_seq = seq;
+            stats.highest_seq += seq_diff;
+        }
+
+        stats.packets++;
+        stats.bytes += map.size;
+
+        double d = std::abs((int32_t)(transit - stats.transit_prev));
+        stats.transit_prev = transit;
+        stats.jitter += (d - stats.jitter) / 16;
+    }
+
+    gst_buffer_unmap(buffer, &map);
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Socket and server address for sending control messages from streaming threads.
+ */
+struct control_channel
+{
+    GSocket *socket;
+    GSocketAddress *server_address;
+};
+
+/**
+ * Turns the retransmission requests of the playback jitter buffer into NACK messages to the server. Requests travel upstream as custom events and stop at the udpsrc.
+ */
+GstPadProbeReturn playback_udpsrc_event_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto channel = (control_channel *)user_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_UPSTREAM || !gst_event_has_name(event, "GstRTPRetransmissionRequest"))
+        return GST_PAD_PROBE_OK;
+
+    const GstStructure *structure = gst_event_get_structure(event);
+    guint seqnum;
+    guint ssrc;
+    if (gst_structure_get_uint(structure, "seqnum", &seqnum) && gst_structure_get_uint(structure, "ssrc", &ssrc))
+    {
+        char message[CONTROL_NACK_LEN];
+        const auto message_len = control_nack_make(message, ssrc, seqnum);
+        if (g_socket_send_to(channel->socket, channel->server_address, message, message_len, nullptr, nullptr) == -1)
+        {
+            g_print("Failed to send NACK message.\n");
+        }
+    }
+    return GST_PAD_PROBE_DROP;
+}
+
+/**
+ * Adds the capture time to each packet of the sent video. The pipeline is given as user_data, for its clock.
+ */
+GstPadProbeReturn capture_rtph264pay_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto pipeline = (GstElement *)user_data;
+    probe_buffers_modify(info, [&](GstBuffer *buffer)
+                         {
+                             GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+                             if (!gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+                                 return;
+                             rtp_capture_time_add(&rtp, capture_time_get(pipeline, GST_BUFFER_PTS(buffer)));
+                             gst_rtp_buffer_unmap(&rtp); });
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Measures the end-to-end latency of the sources of each frame about to be displayed, given the frame timings of the stream as user_data. The latency of other sources is only accurate with clocks synchronized across machines, e.g. by NTP.
+ */
+GstPadProbeReturn playback_display_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto &timings = *(frame_timings *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    frame_timing timing;
+    {
+        std::lock_guard<std::mutex> lock(timings.mutex);
+        if (!frame_timings_find(timings.frames, pts, timing))
+            return GST_PAD_PROBE_OK;
+    }
+
+    gint64 current_time = g_get_real_time();
+    std::lock_guard<std::mutex> lock(latency_stats_mutex);
+    for (const auto &source : timing.capture_times)
+    {
+        auto &stats = latency_stats[source.ssrc];
+        gint64 latency = current_time - source.capture_time;
+        stats.sum += latency;
+        stats.max = std::max(stats.max, latency);
+        stats.count++;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Prints the end-to-end latency of each source since the previous report.
+ */
+void print_latency_stats()
+{
+    std::lock_guard<std::mutex> lock(latency_stats_mutex);
+    for (const auto &entry : latency_stats)
+    {
+        const auto &stats = entry.second;
+        g_print("Latency (source %08x%s): %.1f ms average, %.1f ms maximum, over %u frames\n", entry.first, entry.first == capture_ssrc ? ", own" : "", stats.sum / 1000.0 / stats.count, stats.max / 1000.0, stats.count);
+    }
+    latency_stats.clear();
+}
+
+/**
+ * Summarizes the reception statistics since the previous report. Returns false if no composite video has been received yet.
+ */
+bool reception_stats_report(receiver_report &report)
+{
+    std::lock_guard<std::mutex> lock(playback_stats.mutex);
+    auto &stats = playback_stats;
+    gint64 current_time = g_get_monotonic_time();
+
+    if (!stats.has_packet)
+    {
+        stats.report_time = current_time;
+        return false;
+    }
+
+    int64_t expected = stats.highest_seq - stats.report_seq;
+    int64_t lost = std::max<int64_t>(0, expected - stats.packets);
+    gint64 elapsed = std::max<gint64>(1, current_time - stats.report_time);
+
+    report.loss_permille = expected > 0 ? std::min<int64_t>(1000, lost * 1000 / expected) : 0;
+    report.jitter_ms = std::min(65535.0, stats.jitter / 90);
+    // bytes * 8 / (elapsed / 1000000) / 1000
+    report.rate_kbps = stats.bytes * 8000 / elapsed;
+
+    stats.report_seq = stats.highest_seq;
+    stats.packets = 0;
+    stats.bytes = 0;
+    stats.report_time = current_time;
+    return true;
+}
+
+/**
+ * Playback pipeline description: udpsrc name=udpsrc caps="application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264, payload=(int)96" ! rtpstorage size-time=250000000 ! rtpjitterbuffer name=rtpjitterbuffer latency={mode latency} do-retransmission={mode retransmission} do-lost=true ! rtpulpfecdec pt=122 ! rtph264depay ! avdec_h264 ! videoconvert ! autovideosink
+ * Retransmission requests are sent to the server over the control channel.
+ */
+GstElement *playback_pipeline_make(GSocket *socket, jitterbuffer_mode mode, control_channel *channel)
 {
     GstElement *pipeline = gst_pipeline_new("playback-pipeline");
 
     GstElement *udpsrc = gst_element_factory_make("udpsrc", "udpsrc");
+    GstElement *rtpstorage = gst_element_factory_make("rtpstorage", "rtpstorage");
+    GstElement *rtpjitterbuffer = gst_element_factory_make("rtpjitterbuffer", "rtpjitterbuffer");
+    GstElement *rtpulpfecdec = gst_element_factory_make("rtpulpfecdec", "rtpulpfecdec");
     GstElement *rtph264depay = gst_element_factory_make("rtph264depay", "rtph264depay");
     GstElement *avdec_h264 = gst_element_factory_make("avdec_h264", "avdec_h264");
     GstElement *videoconvert = gst_element_factory_make("videoconvert", "videoconvert");
     GstElement *autovideosink = gst_element_factory_make("autovideosink", "autovideosink");
 
-    if (!pipeline || !udpsrc || !rtph264depay || !avdec_h264 || !videoconvert || !autovideosink)
+    if (!pipeline || !udpsrc || !rtpstorage || !rtpjitterbuffer || !rtpulpfecdec || !rtph264depay || !avdec_h264 || !videoconvert || !autovideosink)
     {
         g_printerr("Failed to create playback pipeline elements.\n");
         return nullptr;
@@ -40,9 +363,25 @@ GstElement *playback_pipeline_make(GSocket *socket)
 
     gst_caps_unref(caps);
 
-    gst_bin_add_many(GST_BIN(pipeline), udpsrc, rtph264depay, avdec_h264, videoconvert, autovideosink, nullptr);
+    jitterbuffer_configure(rtpjitterbuffer, mode);
+    g_signal_connect(rtpjitterbuffer, "request-pt-map", G_CALLBACK(jitterbuffer_request_pt_map), nullptr);
+
+    // FEC packets from the server, if it sends them, are used to recover lost packets and then dropped
+    init_fec_recovery(rtpstorage, rtpjitterbuffer, rtpulpfecdec);
+
+    GstPad *udpsrc_src_pad = gst_element_get_static_pad(udpsrc, "src");
+    gst_pad_add_probe(udpsrc_src_pad, GST_PAD_PROBE_TYPE_BUFFER, playback_udpsrc_probe, &playback_stats, nullptr);
+    gst_pad_add_probe(udpsrc_src_pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, playback_udpsrc_event_probe, channel, nullptr);
+    gst_object_unref(udpsrc_src_pad);
+
+    frame_timings_attach(rtph264depay, &playback_timings);
+    GstPad *autovideosink_sink_pad = gst_element_get_static_pad(autovideosink, "sink");
+    gst_pad_add_probe(autovideosink_sink_pad, GST_PAD_PROBE_TYPE_BUFFER, playback_display_probe, &playback_timings, nullptr);
+    gst_object_unref(autovideosink_sink_pad);
+
+    gst_bin_add_many(GST_BIN(pipeline), udpsrc, rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264, videoconvert, autovideosink, nullptr);
 
-    if (!gst_element_link_many(udpsrc, rtph264depay, avdec_h264, videoconvert, autovideosink, nullptr))
+    if (!gst_element_link_many(udpsrc, rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264, videoconvert, autovideosink, nullptr))
     {
         g_printerr("Failed to link playback pipeline elements.\n");
         gst_object_unref(pipeline);
@@ -53,10 +392,372 @@ GstElement *playback_pipeline_make(GSocket *socket)
 }
 
 /**
- * Capture pipeline description: v4l2src device=/dev/video0 ! videoconvert ! videoscale ! video/x-raw, framerate=30/1, width=320, height=240 ! videoscale ! videoconvert ! x264enc tune=zerolatency bitrate=500 speed-preset=superfast ! rtph264pay ! udpsink name=udpsink host=127.0.0.1 port=27884
- * Test capture pipeline description: videotestsrc pattern=ball ! videoconvert ! videoscale ! video/x-raw, framerate=30/1, width=320, height=240 ! videoscale ! videoconvert ! x264enc tune=zerolatency bitrate=500 speed-preset=superfast ! rtph264pay ! udpsink name=udpsink host=127.0.0.1 port=27884
+ * Source stream received in SFU mode, composited locally.
+ */
+struct sfu_stream
+{
+    uint32_t ssrc;
+    // Elements in link order, starting with the rtpstorage linked to the rtpssrcdemux pad of the stream
+    std::vector<GstElement *> elements;
+    GstPad *compositor_pad;
+    // Last packet arrival time
+    std::atomic<gint64> activity;
+    frame_timings timings;
+};
+
+/**
+ * SFU playback state: the streams are added by the streaming thread of the rtpssrcdemux and removed by the main loop when inactive.
+ */
+struct sfu_playback
+{
+    GstElement *pipeline;
+    GstElement *rtpssrcdemux;
+    GstElement *compositor;
+    jitterbuffer_mode mode;
+    // Cell size of the streams, as configured by the server
+    server_config config;
+    std::vector<sfu_stream *> streams;
+    std::mutex streams_mutex;
+};
+
+/**
+ * Places the streams on a grid as square as possible, in order of arrival. Called with streams_mutex held.
+ */
+void sfu_streams_layout(sfu_playback &playback)
+{
+    size_t count = playback.streams.size();
+    size_t cols = 1;
+    while (cols * cols < count)
+    {
+        cols++;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        g_object_set(playback.streams[i]->compositor_pad, "xpos", (int)(playback.config.cell_width * (i % cols)), "ypos", (int)(playback.config.cell_height * (i / cols)), nullptr);
+    }
+}
+
+GstPadProbeReturn sfu_stream_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto stream = (sfu_stream *)user_data;
+    stream->activity = g_get_monotonic_time();
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Stops a stream sub-pipeline and removes it from the pipeline, releasing its compositor pad.
  */
-GstElement *capture_pipeline_make(bool is_test, std::string device, std::string server_host, int server_port, GSocket *socket)
+void sfu_stream_remove(sfu_playback &playback, sfu_stream *stream)
+{
+    for (auto element : stream->elements)
+    {
+        gst_element_set_state(element, GST_STATE_NULL);
+    }
+    if (stream->compositor_pad)
+    {
+        gst_element_release_request_pad(playback.compositor, stream->compositor_pad);
+        gst_object_unref(stream->compositor_pad);
+    }
+    for (auto element : stream->elements)
+    {
+        gst_bin_remove(GST_BIN(playback.pipeline), element);
+    }
+    // The rtpssrcdemux pad of the stream is removed as well, so that a returning stream gets a new one
+    g_signal_emit_by_name(playback.rtpssrcdemux, "clear-ssrc", stream->ssrc);
+    delete stream;
+}
+
+/**
+ * Stream sub-pipeline description: rtpssrcdemux. ! rtpstorage ! rtpjitterbuffer do-lost=true ! rtpulpfecdec pt=122 ! rtph264depay ! avdec_h264 ! videoconvert ! videoscale ! video/x-raw, width={cell width}, height={cell height} ! compositor.
+ * Built when rtpssrcdemux finds a new SSRC.
+ */
+void sfu_new_ssrc_pad(GstElement *rtpssrcdemux, guint ssrc, GstPad *pad, gpointer user_data)
+{
+    auto &playback = *(sfu_playback *)user_data;
+    std::string stream_name = std::string("stream") + std::to_string(ssrc);
+
+    GstElement *rtpstorage = gst_element_factory_make("rtpstorage", (stream_name + "_rtpstorage").c_str());
+    GstElement *rtpjitterbuffer = gst_element_factory_make("rtpjitterbuffer", (stream_name + "_rtpjitterbuffer").c_str());
+    GstElement *rtpulpfecdec = gst_element_factory_make("rtpulpfecdec", (stream_name + "_rtpulpfecdec").c_str());
+    GstElement *rtph264depay = gst_element_factory_make("rtph264depay", (stream_name + "_rtph264depay").c_str());
+    GstElement *avdec_h264 = gst_element_factory_make("avdec_h264", (stream_name + "_avdec_h264").c_str());
+    GstElement *videoconvert = gst_element_factory_make("videoconvert", (stream_name + "_videoconvert").c_str());
+    GstElement *videoscale = gst_element_factory_make("videoscale", (stream_name + "_videoscale").c_str());
+    GstElement *capsfilter = gst_element_factory_make("capsfilter", (stream_name + "_capsfilter").c_str());
+
+    if (!rtpstorage || !rtpjitterbuffer || !rtpulpfecdec || !rtph264depay || !avdec_h264 || !videoconvert || !videoscale || !capsfilter)
+    {
+        g_printerr("Failed to create stream elements.\n");
+        return;
+    }
+
+    init_fec_recovery(rtpstorage, rtpjitterbuffer, rtpulpfecdec);
+    jitterbuffer_configure(rtpjitterbuffer, playback.mode);
+    // The server does not keep source packets for retransmission in SFU mode
+    g_object_set(rtpjitterbuffer, "do-retransmission", false, nullptr);
+    g_signal_connect(rtpjitterbuffer, "request-pt-map", G_CALLBACK(jitterbuffer_request_pt_map), nullptr);
+
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "width", G_TYPE_INT, playback.config.cell_width,
+                                        "height", G_TYPE_INT, playback.config.cell_height,
+                                        nullptr);
+    g_object_set(capsfilter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    auto stream = new sfu_stream{};
+    stream->ssrc = ssrc;
+    stream->activity = g_get_monotonic_time();
+    stream->elements = {rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264, videoconvert, videoscale, capsfilter};
+
+    gst_bin_add_many(GST_BIN(playback.pipeline), rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264, videoconvert, videoscale, capsfilter, nullptr);
+    gst_element_link_many(rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264, videoconvert, videoscale, capsfilter, nullptr);
+
+    GstPad *capsfilter_src_pad = gst_element_get_static_pad(capsfilter, "src");
+    stream->compositor_pad = gst_element_request_pad_simple(playback.compositor, "sink_%u");
+    gst_pad_link(capsfilter_src_pad, stream->compositor_pad);
+    gst_object_unref(capsfilter_src_pad);
+
+    // Source clients stream to the server, which forwards their capture times as they are
+    frame_timings_attach(rtph264depay, &stream->timings);
+    gst_pad_add_probe(stream->compositor_pad, GST_PAD_PROBE_TYPE_BUFFER, playback_display_probe, &stream->timings, nullptr);
+
+    GstPad *rtpstorage_sink_pad = gst_element_get_static_pad(rtpstorage, "sink");
+    gst_pad_add_probe(rtpstorage_sink_pad, GST_PAD_PROBE_TYPE_BUFFER, sfu_stream_probe, stream, nullptr);
+    gst_pad_link(pad, rtpstorage_sink_pad);
+    gst_object_unref(rtpstorage_sink_pad);
+
+    // Downstream elements first, so that no element pushes to a stopped one
+    for (auto element = stream->elements.rbegin(); element != stream->elements.rend(); element++)
+    {
+        gst_element_sync_state_with_parent(*element);
+    }
+
+    std::lock_guard<std::mutex> lock(playback.streams_mutex);
+    playback.streams.push_back(stream);
+    sfu_streams_layout(playback);
+    if (playback.mode == jitterbuffer_mode::adaptive)
+    {
+        std::lock_guard<std::mutex> jitterbuffers_lock(adaptive_jitterbuffers_mutex);
+        adaptive_jitterbuffers.push_back(rtpjitterbuffer);
+    }
+}
+
+/**
+ * Removes streams that have been inactive for a while, e.g. of source clients that left the room. Runs periodically in the main loop.
+ */
+gboolean sfu_streams_check(gpointer user_data)
+{
+    auto &playback = *(sfu_playback *)user_data;
+    gint64 current_time = g_get_monotonic_time();
+
+    std::lock_guard<std::mutex> lock(playback.streams_mutex);
+    auto stream_it = playback.streams.begin();
+    bool has_removal_occurred = false;
+    while (stream_it != playback.streams.end())
+    {
+        auto stream = *stream_it;
+        if (current_time - stream->activity <= 2000000)
+        {
+            stream_it++;
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> jitterbuffers_lock(adaptive_jitterbuffers_mutex);
+            auto jitterbuffer_it = std::find(adaptive_jitterbuffers.begin(), adaptive_jitterbuffers.end(), stream->elements[1]);
+            if (jitterbuffer_it != adaptive_jitterbuffers.end())
+                adaptive_jitterbuffers.erase(jitterbuffer_it);
+        }
+        stream_it = playback.streams.erase(stream_it);
+        sfu_stream_remove(playback, stream);
+        has_removal_occurred = true;
+    }
+    if (has_removal_occurred)
+    {
+        sfu_streams_layout(playback);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * SFU playback pipeline description: udpsrc name=udpsrc caps="application/x-rtp, ..." ! rtpssrcdemux name=rtpssrcdemux, compositor name=compositor background=black ! videoconvert ! autovideosink
+ * A stream sub-pipeline is linked between the rtpssrcdemux and the compositor for each source, see sfu_new_ssrc_pad().
+ */
+GstElement *sfu_playback_pipeline_make(GSocket *socket, sfu_playback &playback)
+{
+    GstElement *pipeline = gst_pipeline_new("playback-pipeline");
+
+    GstElement *udpsrc = gst_element_factory_make("udpsrc", "udpsrc");
+    GstElement *rtpssrcdemux = gst_element_factory_make("rtpssrcdemux", "rtpssrcdemux");
+    GstElement *compositor = gst_element_factory_make("compositor", "compositor");
+    GstElement *videoconvert = gst_element_factory_make("videoconvert", "videoconvert");
+    GstElement *autovideosink = gst_element_factory_make("autovideosink", "autovideosink");
+
+    if (!pipeline || !udpsrc || !rtpssrcdemux || !compositor || !videoconvert || !autovideosink)
+    {
+        g_printerr("Failed to create playback pipeline elements.\n");
+        return nullptr;
+    }
+
+    GstCaps *caps = gst_caps_new_simple("application/x-rtp",
+                                        "media", G_TYPE_STRING, "video",
+                                        "clock-rate", G_TYPE_INT, 90000,
+                                        "encoding-name", G_TYPE_STRING, "H264",
+                                        "payload", G_TYPE_INT, 96,
+                                        nullptr);
+
+    g_object_set(udpsrc, "caps", caps, "socket", socket, nullptr);
+
+    gst_caps_unref(caps);
+
+    // background: black (1) – Black
+    g_object_set(compositor, "background", 1, nullptr);
+
+    // Control messages are handled and dropped, no composite reception statistics are gathered
+    GstPad *udpsrc_src_pad = gst_element_get_static_pad(udpsrc, "src");
+    gst_pad_add_probe(udpsrc_src_pad, GST_PAD_PROBE_TYPE_BUFFER, playback_udpsrc_probe, nullptr, nullptr);
+    gst_object_unref(udpsrc_src_pad);
+
+    gst_bin_add_many(GST_BIN(pipeline), udpsrc, rtpssrcdemux, compositor, videoconvert, autovideosink, nullptr);
+
+    if (!gst_element_link(udpsrc, rtpssrcdemux) || !gst_element_link_many(compositor, videoconvert, autovideosink, nullptr))
+    {
+        g_printerr("Failed to link playback pipeline elements.\n");
+        gst_object_unref(pipeline);
+        return nullptr;
+    }
+
+    playback.pipeline = pipeline;
+    playback.rtpssrcdemux = rtpssrcdemux;
+    playback.compositor = compositor;
+    g_signal_connect(rtpssrcdemux, "new-ssrc-pad", G_CALLBACK(sfu_new_ssrc_pad), &playback);
+
+    return pipeline;
+}
+
+/**
+ * Waits for the server configuration, sent in reply to join messages. Other packets received meanwhile are discarded. Returns false on timeout.
+ */
+bool server_config_wait(GSocket *socket, server_config &config)
+{
+    gint64 deadline = g_get_monotonic_time() + 5000000;
+    char buffer[4096];
+
+    while (true)
+    {
+        gint64 timeout = deadline - g_get_monotonic_time();
+        if (timeout <= 0 || !g_socket_condition_timed_wait(socket, G_IO_IN, timeout, nullptr, nullptr))
+            return false;
+
+        gssize len = g_socket_receive(socket, buffer, sizeof(buffer), nullptr, nullptr);
+        if (len > 0 && control_message_is(buffer, len) && control_message_type(buffer) == CONTROL_CONFIG && control_config_parse(buffer, len, config))
+            return true;
+    }
+}
+
+/**
+ * How captured video reaches the encoder: as the source supplies it, decoded from MJPEG, or converted and scaled from another raw format or size.
+ */
+enum class capture_mode
+{
+    direct,
+    mjpeg,
+    convert
+};
+
+/**
+ * Makes the caps of captured video of the given media type and, if not nullptr, format, at the cell size and frame rate.
+ */
+GstCaps *capture_caps_make(const char *media_type, const char *format, const server_config &config)
+{
+    GstCaps *caps = gst_caps_new_simple(media_type,
+                                        "framerate", GST_TYPE_FRACTION, config.framerate, 1,
+                                        "width", G_TYPE_INT, config.cell_width,
+                                        "height", G_TYPE_INT, config.cell_height,
+                                        nullptr);
+    if (format)
+    {
+        gst_caps_set_simple(caps, "format", G_TYPE_STRING, format, nullptr);
+    }
+    return caps;
+}
+
+/**
+ * Queries the formats and sizes the source supports, which, for v4l2src, opens the device, and picks how its video reaches the encoder, preferring raw formats the encoder takes (I420, NV12) at the cell size, then MJPEG at the cell size, then MJPEG at any size, since decoding it costs less than converting raw formats at higher sizes. Sets the caps to request from the source.
+ */
+capture_mode capture_mode_choose(GstElement *src, const server_config &config, GstCaps *&src_caps)
+{
+    GstCaps *device_caps = nullptr;
+    if (gst_element_set_state(src, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE)
+    {
+        GstPad *src_pad = gst_element_get_static_pad(src, "src");
+        device_caps = gst_pad_query_caps(src_pad, nullptr);
+        gst_object_unref(src_pad);
+    }
+    gst_element_set_state(src, GST_STATE_NULL);
+
+    capture_mode mode = capture_mode::convert;
+    src_caps = gst_caps_new_empty_simple("video/x-raw");
+    if (device_caps)
+    {
+        for (const char *format : {"I420", "NV12"})
+        {
+            GstCaps *caps = capture_caps_make("video/x-raw", format, config);
+            if (gst_caps_can_intersect(device_caps, caps))
+            {
+                gst_caps_unref(src_caps);
+                src_caps = caps;
+                mode = capture_mode::direct;
+                break;
+            }
+            gst_caps_unref(caps);
+        }
+
+        if (mode == capture_mode::convert)
+        {
+            GstCaps *caps = capture_caps_make("image/jpeg", nullptr, config);
+            GstCaps *any_size_caps = gst_caps_new_empty_simple("image/jpeg");
+            if (gst_caps_can_intersect(device_caps, caps))
+            {
+                std::swap(src_caps, caps);
+                mode = capture_mode::mjpeg;
+            }
+            else if (gst_caps_can_intersect(device_caps, any_size_caps))
+            {
+                std::swap(src_caps, any_size_caps);
+                mode = capture_mode::mjpeg;
+            }
+            gst_caps_unref(caps);
+            gst_caps_unref(any_size_caps);
+        }
+        gst_caps_unref(device_caps);
+    }
+    return mode;
+}
+
+/**
+ * Releases the elements created for a pipeline that could not be completed, skipping those that failed to be created. Elements not added to a bin are still floating, which gst_object_unref() handles.
+ */
+void elements_unref(const std::vector<GstElement *> &elements)
+{
+    for (auto element : elements)
+    {
+        if (element)
+        {
+            gst_object_unref(element);
+        }
+    }
+}
+
+/**
+ * Capture pipeline description, depending on the capture mode, with the cell size and frame rate configured by the server:
+ * direct: v4l2src device=/dev/video0 ! video/x-raw, format=I420, framerate={framerate}/1, width={cell width}, height={cell height} ! videoscale ! capsfilter name=capsfilter caps="video/x-raw, framerate={framerate}/1, width={cell width}, height={cell height}" ! x264enc tune=zerolatency bitrate={cell bitrate} speed-preset=superfast ! rtph264pay config-interval=-1 ! rtpulpfecenc pt=122 percentage={fec_percentage} ! udpsink name=udpsink host=127.0.0.1 port=27884 max-bitrate={pacing rate}
+ * mjpeg: v4l2src device=/dev/video0 ! image/jpeg, framerate={framerate}/1, width={cell width}, height={cell height} ! jpegdec ! videoconvert ! videoscale ! videorate ! capsfilter name=capsfilter caps="video/x-raw, format=I420, framerate={framerate}/1, width={cell width}, height={cell height}" ! x264enc ...
+ * convert: v4l2src device=/dev/video0 ! video/x-raw ! videoconvert ! videoscale ! videorate ! capsfilter name=capsfilter caps="video/x-raw, format=I420, framerate={framerate}/1, width={cell width}, height={cell height}" ! x264enc ...
+ * Test capture pipeline description: videotestsrc pattern=ball ! video/x-raw, format=I420, framerate={framerate}/1, width={cell width}, height={cell height} ! videoscale ! capsfilter name=capsfilter ... ! x264enc ...
+ * videoconvert, videoscale and videorate pass buffers through untouched when MJPEG is decoded to I420 at the cell size and frame rate.
+ * The size of the capsfilter caps follows the cell messages of the server, which shrinks cells to fit more sources in the composite, so that the video is scaled down before encoding rather than encoded at a size the server would scale down after decoding. The webcam keeps capturing at the configured cell size.
+ */
+GstElement *capture_pipeline_make(bool is_test, std::string device, const server_config &config, int fec_percentage, std::string server_host, int server_port, GSocket *socket)
 {
     GstElement *pipeline = gst_pipeline_new("capture-pipeline");
 
@@ -69,18 +770,16 @@ GstElement *capture_pipeline_make(bool is_test, std::string device, std::string
     {
         src = gst_element_factory_make("v4l2src", "v4l2src");
     }
-    GstElement *videoconvert1 = gst_element_factory_make("videoconvert", "videoconvert1");
-    GstElement *videoscale1 = gst_element_factory_make("videoscale", "videoscale1");
-    GstElement *capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
-    GstElement *videoscale2 = gst_element_factory_make("videoscale", "videoscale2");
-    GstElement *videoconvert2 = gst_element_factory_make("videoconvert", "videoconvert2");
+    GstElement *src_capsfilter = gst_element_factory_make("capsfilter", "src_capsfilter");
     GstElement *x264enc = gst_element_factory_make("x264enc", "x264enc");
     GstElement *rtph264pay = gst_element_factory_make("rtph264pay", "rtph264pay");
+    GstElement *rtpulpfecenc = gst_element_factory_make("rtpulpfecenc", "rtpulpfecenc");
     GstElement *udpsink = gst_element_factory_make("udpsink", "udpsink");
 
-    if (!pipeline || !src || !videoconvert1 || !videoscale1 || !capsfilter || !videoscale2 || !videoconvert2 || !x264enc || !rtph264pay || !udpsink)
+    if (!pipeline || !src || !src_capsfilter || !x264enc || !rtph264pay || !rtpulpfecenc || !udpsink)
     {
         g_printerr("Failed to create capture pipeline elements.\n");
+        elements_unref({pipeline, src, src_capsfilter, x264enc, rtph264pay, rtpulpfecenc, udpsink});
         return nullptr;
     }
 
@@ -94,45 +793,103 @@ GstElement *capture_pipeline_make(bool is_test, std::string device, std::string
         g_object_set(src, "device", device.c_str(), nullptr);
     }
 
-    // TODO Allow higher framerate, when supported by the webcam
-    GstCaps *caps = gst_caps_new_simple("video/x-raw",
-                                        "framerate", GST_TYPE_FRACTION, 30, 1,
-                                        "width", G_TYPE_INT, 320,
-                                        "height", G_TYPE_INT, 240,
-                                        nullptr);
-    g_object_set(capsfilter, "caps", caps, nullptr);
-    gst_caps_unref(caps);
+    GstCaps *src_caps;
+    capture_mode mode = capture_mode_choose(src, config, src_caps);
+    g_object_set(src_capsfilter, "caps", src_caps, nullptr);
+    gst_caps_unref(src_caps);
+    if (!is_test)
+    {
+        const char *mode_description = mode == capture_mode::direct ? "as supplied" : (mode == capture_mode::mjpeg ? "decoded from MJPEG" : "converted");
+        std::cout << "Capture: " << device << " video goes to the encoder " << mode_description << "." << std::endl;
+    }
+
+    // Elements between the source and the encoder
+    std::vector<GstElement *> converters;
+    if (mode == capture_mode::mjpeg)
+    {
+        converters.push_back(gst_element_factory_make("jpegdec", "jpegdec"));
+    }
+    if (mode != capture_mode::direct)
+    {
+        converters.push_back(gst_element_factory_make("videoconvert", "videoconvert"));
+    }
+    converters.push_back(gst_element_factory_make("videoscale", "videoscale"));
+    if (mode != capture_mode::direct)
+    {
+        // Webcams falling back to other frame rates are brought to the configured one
+        converters.push_back(gst_element_factory_make("videorate", "videorate"));
+    }
+    GstElement *capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
+    if (capsfilter)
+    {
+        // Formats supplied directly are taken by the encoder as they are
+        GstCaps *caps = capture_caps_make("video/x-raw", mode == capture_mode::direct ? nullptr : "I420", config);
+        g_object_set(capsfilter, "caps", caps, nullptr);
+        gst_caps_unref(caps);
+    }
+    converters.push_back(capsfilter);
+    if (std::find(converters.begin(), converters.end(), nullptr) != converters.end())
+    {
+        g_printerr("Failed to create capture pipeline elements.\n");
+        elements_unref({pipeline, src, src_capsfilter, x264enc, rtph264pay, rtpulpfecenc, udpsink});
+        elements_unref(converters);
+        return nullptr;
+    }
 
     // tune: zerolatency (0x00000004) – Zero latency
-    // bitrate: 500
     // speed-preset: ultrafast (1) – ultrafast / superfast (2) – superfast
-    g_object_set(x264enc, "tune", 4, "bitrate", 500, "speed-preset", 2, nullptr);
+    g_object_set(x264enc, "tune", 4, "speed-preset", 2, nullptr);
+    capture_bitrate_set(x264enc, udpsink, config.cell_width, config.cell_height, config.framerate);
+    // config-interval: -1 – Send SPS and PPS with every IDR frame, so that the server can decode from any keyframe
+    capture_ssrc = g_random_int();
+    g_object_set(rtph264pay, "config-interval", -1, "ssrc", (guint)capture_ssrc, nullptr);
+    // percentage: 0 – No FEC packets
+    g_object_set(rtpulpfecenc, "pt", FEC_PAYLOAD_TYPE, "percentage", fec_percentage, nullptr);
     g_object_set(udpsink, "host", server_host.c_str(), "port", server_port, "socket", socket, nullptr);
 
-    gst_bin_add_many(GST_BIN(pipeline), src, videoconvert1, videoscale1, capsfilter, videoscale2, videoconvert2, x264enc, rtph264pay, udpsink, nullptr);
-    if (!gst_element_link_many(src, videoconvert1, videoscale1, capsfilter, videoscale2, videoconvert2, x264enc, rtph264pay, udpsink, nullptr))
+    std::vector<GstElement *> elements = {src, src_capsfilter};
+    elements.insert(elements.end(), converters.begin(), converters.end());
+    elements.insert(elements.end(), {x264enc, rtph264pay, rtpulpfecenc, udpsink});
+
+    bool is_linked = true;
+    for (size_t i = 0; i < elements.size(); i++)
+    {
+        gst_bin_add(GST_BIN(pipeline), elements[i]);
+        if (i > 0 && !gst_element_link(elements[i - 1], elements[i]))
+        {
+            is_linked = false;
+        }
+    }
+    if (!is_linked)
     {
         g_printerr("Failed to link capture pipeline elements.\n");
         gst_object_unref(pipeline);
         return nullptr;
     }
 
+    GstPad *rtph264pay_src_pad = gst_element_get_static_pad(rtph264pay, "src");
+    gst_pad_add_probe(rtph264pay_src_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), capture_rtph264pay_probe, pipeline, nullptr);
+    gst_object_unref(rtph264pay_src_pad);
+
     return pipeline;
 }
 
 void print_usage(char *program_name)
 {
-    fprintf(stderr, "Usage: %s [-r] [-t] [-d device] [-p serverport] [serverhost]\n", program_name);
+    fprintf(stderr, "Usage: %s [-r] [-t] [-d device] [-j room] [-q rendition] [-f fecpercentage] [-P pacingmultiple] [-l minimal|smooth|adaptive] [-p serverport] [serverhost]\n", program_name);
 }
 
 /**
- * Periodically send keepalive messages.
+ * Periodically send join messages, which also keep the client active, and receiver reports. In adaptive playout delay mode, the playback jitter buffer is resized at the same pace. The end-to-end latency of the sources is printed every 8 seconds.
  */
-void keep_alive(std::string server_host, int server_port, GSocket *socket)
+void keep_alive(std::string server_host, int server_port, std::string room_name, uint8_t rendition, GSocket *socket)
 {
     GSocketAddress *address = g_inet_socket_address_new(g_inet_address_new_from_string(server_host.c_str()), server_port);
-    const auto *message = "";
-    const auto message_len = strlen(message);
+    char message[CONTROL_JOIN_MAX_LEN];
+    const auto message_len = control_join_make(message, room_name, rendition);
+    char report_message[CONTROL_REPORT_LEN];
+    receiver_report report;
+    int iteration = 0;
 
     while (true)
     {
@@ -142,23 +899,50 @@ void keep_alive(std::string server_host, int server_port, GSocket *socket)
             g_print("Failed to send keepalive message.\n");
             return;
         }
+        if (reception_stats_report(report))
+        {
+            const auto report_message_len = control_report_make(report_message, report);
+            if (g_socket_send_to(socket, address, report_message, report_message_len, nullptr, nullptr) == -1)
+            {
+                g_print("Failed to send report message.\n");
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(adaptive_jitterbuffers_mutex);
+            for (auto rtpjitterbuffer : adaptive_jitterbuffers)
+            {
+                jitterbuffer_adapt(rtpjitterbuffer, playback_framerate);
+            }
+        }
+        if (++iteration % 8 == 0)
+        {
+            print_latency_stats();
+        }
         std::this_thread::sleep_for(std::chrono::milliseconds(1000));
     }
 }
 
 int main(int argc, char *argv[])
 {
-    // Whether no video is sent, only composite video is received and displayed
+    // Whether no video is sent, only composite video (or, in SFU mode, source videos) is received and displayed
     bool is_recvonly = false;
     // Whether a videotestsrc instead of a webcam device will be used
     bool is_test = false;
     std::string device = "/dev/video0";
+    // Clients in the same room share a composite, the default room is named ""
+    std::string room_name = "";
+    // Index of the composite rendition to receive, 0 being the highest quality one offered by the server
+    uint8_t rendition = 0;
+    // ULPFEC overhead of the sent video, in percent of the media packets, 0 for none
+    int fec_percentage = 0;
+    // Playout delay mode of the composite video
+    jitterbuffer_mode playback_jitterbuffer_mode = jitterbuffer_mode::adaptive;
     std::string server_host = "127.0.0.1";
     int server_port = 27884;
 
     int opt;
 
-    while ((opt = getopt(argc, argv, "rtd:p:h")) != -1)
+    while ((opt = getopt(argc, argv, "rtd:j:q:f:P:l:p:h")) != -1)
     {
         switch (opt)
         {
@@ -171,6 +955,30 @@ int main(int argc, char *argv[])
         case 'd':
             device = optarg;
             break;
+        case 'j':
+            room_name = optarg;
+            if (room_name.size() > ROOM_NAME_MAX_LEN)
+            {
+                std::cerr << "Room name is longer than " << ROOM_NAME_MAX_LEN << " bytes." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            rendition = atoi(optarg);
+            break;
+        case 'f':
+            fec_percentage = std::clamp(atoi(optarg), 0, 100);
+            break;
+        case 'P':
+            pacing_multiple = std::max(0.0, atof(optarg));
+            break;
+        case 'l':
+            if (!jitterbuffer_mode_parse(optarg, playback_jitterbuffer_mode))
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'p':
             server_port = atoi(optarg);
             break;
@@ -213,22 +1021,67 @@ int main(int argc, char *argv[])
     // Create GSocket object for use with udpsrc and udpsink
     GSocket *gsock = g_socket_new_from_fd(sock, nullptr);
 
-    // Create playback pipeline
-    GstElement *playback_pipeline = playback_pipeline_make(gsock);
-    gst_element_set_state(playback_pipeline, GST_STATE_PLAYING);
-
-    std::thread keep_alive_thread;
+    // Join messages are sent before any video, so that the server routes the client to its room from the first packet
+    std::thread keep_alive_thread = std::thread(keep_alive, server_host, server_port, room_name, rendition, gsock);
 
-    GstElement *capture_pipeline;
+    // The playback pipeline depends on the server mode, and both pipelines on the video geometry it configures
+    server_config config;
+    if (!server_config_wait(gsock, config))
+    {
+        std::cerr << "No config received from server, assuming composite mode." << std::endl;
+        config.mode = SERVER_MODE_COMPOSITE;
+    }
+    playback_framerate = config.framerate;
 
-    if (is_recvonly)
+    // Create playback pipeline
+    control_channel channel{gsock, g_inet_socket_address_new(g_inet_address_new_from_string(server_host.c_str()), server_port)};
+    sfu_playback playback;
+    playback.mode = playback_jitterbuffer_mode;
+    playback.config = config;
+    GstElement *playback_pipeline;
+    if (config.mode == SERVER_MODE_SFU)
     {
-        keep_alive_thread = std::thread(keep_alive, server_host, server_port, gsock);
+        playback_pipeline = sfu_playback_pipeline_make(gsock, playback);
+        if (!playback_pipeline)
+        {
+            // The keep-alive thread is running, so the process exits rather than main returning
+            std::cerr << "Failed to create playback pipeline." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        g_timeout_add(1000, sfu_streams_check, &playback);
     }
     else
+    {
+        playback_pipeline = playback_pipeline_make(gsock, playback_jitterbuffer_mode, &channel);
+        if (!playback_pipeline)
+        {
+            std::cerr << "Failed to create playback pipeline." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (playback_jitterbuffer_mode == jitterbuffer_mode::adaptive)
+        {
+            std::lock_guard<std::mutex> lock(adaptive_jitterbuffers_mutex);
+            adaptive_jitterbuffers.push_back(gst_bin_get_by_name(GST_BIN(playback_pipeline), "rtpjitterbuffer"));
+            // The pipeline holds a reference as well
+            gst_object_unref(adaptive_jitterbuffers.back());
+        }
+    }
+    gst_element_set_state(playback_pipeline, GST_STATE_PLAYING);
+
+    GstElement *capture_pipeline;
+
+    if (!is_recvonly)
     {
         // Create capture pipeline
-        capture_pipeline = capture_pipeline_make(is_test, device, server_host, server_port, gsock);
+        capture_pipeline = capture_pipeline_make(is_test, device, config, fec_percentage, server_host, server_port, gsock);
+        if (!capture_pipeline)
+        {
+            std::cerr << "Failed to create capture pipeline." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        capture_x264enc = gst_bin_get_by_name(GST_BIN(capture_pipeline), "x264enc");
+        capture_udpsink = gst_bin_get_by_name(GST_BIN(capture_pipeline), "udpsink");
+        capture_capsfilter = gst_bin_get_by_name(GST_BIN(capture_pipeline), "capsfilter");
         gst_element_set_state(capture_pipeline, GST_STATE_PLAYING);
     }
 
@@ -237,19 +1090,20 @@ int main(int argc, char *argv[])
     g_main_loop_run(loop);
 
     // Clean up
-    if (is_recvonly)
-    {
-        keep_alive_thread.join();
-    }
-    else
+    keep_alive_thread.join();
+    if (!is_recvonly)
     {
         gst_element_set_state(capture_pipeline, GST_STATE_NULL);
+        gst_object_unref(capture_x264enc.exchange(nullptr));
+        gst_object_unref(capture_capsfilter.exchange(nullptr));
+        gst_object_unref(capture_udpsink.exchange(nullptr));
         gst_object_unref(capture_pipeline);
     }
     gst_element_set_state(playback_pipeline, GST_STATE_NULL);
     gst_object_unref(playback_pipeline);
     g_main_loop_unref(loop);
     g_object_unref(gsock);
+    g_object_unref(channel.server_address);
 
     return 0;
 }
@@ -0,0 +1,122 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Harry Nakos <xnakos@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+
+#include <gst/gst.h>
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include "protocol.h"
+
+/**
+ * Playout delay mode of an rtpjitterbuffer.
+ * minimal: the lowest latency, packets late by more than it are dropped.
+ * smooth: enough latency to reorder packets and wait for retransmissions on typical Internet paths.
+ * adaptive: latency follows the observed jitter, see jitterbuffer_adapt().
+ */
+enum class jitterbuffer_mode
+{
+    minimal,
+    smooth,
+    adaptive,
+};
+
+// Playout delay bounds, in milliseconds
+const int JITTERBUFFER_LATENCY_MINIMAL = 30;
+const int JITTERBUFFER_LATENCY_SMOOTH = 200;
+const int JITTERBUFFER_LATENCY_ADAPTIVE_MAX = 400;
+
+inline bool jitterbuffer_mode_parse(const std::string &name, jitterbuffer_mode &mode)
+{
+    if (name == "minimal")
+    {
+        mode = jitterbuffer_mode::minimal;
+    }
+    else if (name == "smooth")
+    {
+        mode = jitterbuffer_mode::smooth;
+    }
+    else if (name == "adaptive")
+    {
+        mode = jitterbuffer_mode::adaptive;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Provides the caps of FEC packets, which have their own payload type, to an rtpjitterbuffer through its request-pt-map signal.
+ */
+inline GstCaps *jitterbuffer_request_pt_map(GstElement *rtpjitterbuffer, guint pt, gpointer user_data)
+{
+    return gst_caps_new_simple("application/x-rtp",
+                               "media", G_TYPE_STRING, "video",
+                               "clock-rate", G_TYPE_INT, 90000,
+                               nullptr);
+}
+
+/**
+ * Sets up ULPFEC recovery: rtpulpfecdec recovers lost packets from the packets kept by the preceding rtpstorage and drops FEC packets. It only recovers a packet when the rtpjitterbuffer between them reports it lost, which the rtpjitterbuffer only does with do-lost.
+ */
+inline void init_fec_recovery(GstElement *rtpstorage, GstElement *rtpjitterbuffer, GstElement *rtpulpfecdec)
+{
+    // Long enough to hold the packets protected by an FEC packet
+    g_object_set(rtpstorage, "size-time", (guint64)250000000, nullptr);
+    GObject *storage;
+    g_object_get(rtpstorage, "internal-storage", &storage, nullptr);
+    g_object_set(rtpulpfecdec, "storage", storage, "pt", FEC_PAYLOAD_TYPE, nullptr);
+    g_object_unref(storage);
+    g_object_set(rtpjitterbuffer, "do-lost", true, nullptr);
+}
+
+/**
+ * Sets the initial playout delay of an rtpjitterbuffer. Retransmissions are requested unless in minimal mode, where they would arrive too late.
+ */
+inline void jitterbuffer_configure(GstElement *rtpjitterbuffer, jitterbuffer_mode mode)
+{
+    switch (mode)
+    {
+    case jitterbuffer_mode::minimal:
+        g_object_set(rtpjitterbuffer, "latency", JITTERBUFFER_LATENCY_MINIMAL, "drop-on-latency", true, "do-retransmission", false, nullptr);
+        break;
+    case jitterbuffer_mode::smooth:
+        g_object_set(rtpjitterbuffer, "latency", JITTERBUFFER_LATENCY_SMOOTH, "do-retransmission", true, nullptr);
+        break;
+    case jitterbuffer_mode::adaptive:
+        // Starts in between, until there is jitter to go by
+        g_object_set(rtpjitterbuffer, "latency", 100, "do-retransmission", true, nullptr);
+        break;
+    }
+}
+
+/**
+ * Sizes the playout delay of an rtpjitterbuffer in adaptive mode after its average jitter: four times the jitter plus a frame interval at the given frame rate of margin, within bounds. Small changes are ignored, since each change disturbs playout.
+ */
+inline void jitterbuffer_adapt(GstElement *rtpjitterbuffer, int framerate)
+{
+    GstStructure *stats;
+    g_object_get(rtpjitterbuffer, "stats", &stats, nullptr);
+    if (stats == nullptr)
+    {
+        return;
+    }
+
+    guint64 avg_jitter_ns = 0;
+    gst_structure_get_uint64(stats, "avg-jitter", &avg_jitter_ns);
+    gst_structure_free(stats);
+
+    int target_latency = std::clamp((int)(4 * avg_jitter_ns / 1000000) + 1000 / std::max(1, framerate), JITTERBUFFER_LATENCY_MINIMAL, JITTERBUFFER_LATENCY_ADAPTIVE_MAX);
+
+    guint latency;
+    g_object_get(rtpjitterbuffer, "latency", &latency, nullptr);
+    if (std::abs(target_latency - (int)latency) > 10)
+    {
+        g_object_set(rtpjitterbuffer, "latency", target_latency, nullptr);
+    }
+}
@@ -0,0 +1,267 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Harry Nakos <xnakos@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// RTP header extension IDs (RFC 8285). Source clients send the capture time of each packet in a one-byte header extension. The server sends the capture times of the sources of each composite frame, in its first packet, in a two-byte header extension.
+const guint8 CAPTURE_TIME_EXTENSION_ID = 1;
+const guint8 SOURCE_CAPTURE_TIMES_EXTENSION_ID = 2;
+
+// Source capture time entry size: SSRC and capture time, in network byte order. A two-byte header extension element holds up to 255 bytes.
+const size_t SOURCE_CAPTURE_TIME_LEN = 12;
+const size_t SOURCE_CAPTURE_TIMES_MAX = 255 / SOURCE_CAPTURE_TIME_LEN;
+
+// Largest source capture times header extension: extension header, element header and entries, padded to 32-bit words
+const size_t SOURCE_CAPTURE_TIMES_EXTENSION_MAX_LEN = (4 + 2 + SOURCE_CAPTURE_TIMES_MAX * SOURCE_CAPTURE_TIME_LEN + 3) / 4 * 4;
+
+// Default mtu of RTP payloaders, which packets with header extensions added after payloading would exceed
+const guint RTP_PAYLOADER_MTU = 1400;
+
+// Frames whose timing is kept for lookup further down the pipeline
+const size_t FRAME_TIMINGS_MAX = 64;
+
+struct source_capture_time
+{
+    uint32_t ssrc;
+    // Wall-clock time (g_get_real_time()), in microseconds, so that it is comparable across machines with synchronized clocks
+    gint64 capture_time;
+};
+
+/**
+ * Timing of a frame: the capture times of its sources and, in the server, the arrival time (g_get_monotonic_time()) of the newest of them.
+ */
+struct frame_timing
+{
+    std::vector<source_capture_time> capture_times;
+    gint64 ingress_time = 0;
+};
+
+/**
+ * Timing of the frames of a stream, kept by its streaming threads, since RTP packets lose their header extensions when depayloaded, while buffers keep their PTS through decoding and encoding.
+ */
+struct frame_timings
+{
+    std::mutex mutex;
+    // Timing parsed from the packets of the frame being depayloaded, and the RTP timestamps of that frame and of the latest packet
+    frame_timing pending;
+    uint32_t pending_timestamp = 0;
+    bool has_pending = false;
+    uint32_t last_timestamp = 0;
+    // Timing of frames by PTS, oldest first
+    std::deque<std::pair<GstClockTime, frame_timing>> frames;
+    // Arrival times of frames by RTP timestamp, oldest first (server only)
+    std::deque<std::pair<uint32_t, gint64>> ingress_times;
+};
+
+/**
+ * Returns the wall-clock time at which a buffer with the given PTS was captured, i.e. the current time minus how long the buffer has been in the pipeline of the element.
+ */
+inline gint64 capture_time_get(GstElement *element, GstClockTime pts)
+{
+    gint64 current_time = g_get_real_time();
+    GstClock *clock = gst_element_get_clock(element);
+    if (clock == nullptr || pts == GST_CLOCK_TIME_NONE)
+    {
+        if (clock)
+            gst_object_unref(clock);
+        return current_time;
+    }
+    GstClockTime running_time = gst_clock_get_time(clock) - gst_element_get_base_time(element);
+    gst_object_unref(clock);
+    return running_time > pts ? current_time - (gint64)((running_time - pts) / GST_USECOND) : current_time;
+}
+
+inline void capture_time_write(guint8 *data, gint64 capture_time)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        data[i] = capture_time & 0xff;
+        capture_time >>= 8;
+    }
+}
+
+inline gint64 capture_time_read(const guint8 *data)
+{
+    gint64 capture_time = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        capture_time = (capture_time << 8) | data[i];
+    }
+    return capture_time;
+}
+
+/**
+ * Adds the capture time header extension to a mapped RTP packet of a source client.
+ */
+inline bool rtp_capture_time_add(GstRTPBuffer *rtp, gint64 capture_time)
+{
+    guint8 data[8];
+    capture_time_write(data, capture_time);
+    return gst_rtp_buffer_add_extension_onebyte_header(rtp, CAPTURE_TIME_EXTENSION_ID, data, sizeof(data));
+}
+
+/**
+ * Adds the source capture times header extension to a mapped composite RTP packet.
+ */
+inline bool rtp_source_capture_times_add(GstRTPBuffer *rtp, const std::vector<source_capture_time> &capture_times)
+{
+    guint8 data[SOURCE_CAPTURE_TIMES_MAX * SOURCE_CAPTURE_TIME_LEN];
+    size_t count = std::min(capture_times.size(), SOURCE_CAPTURE_TIMES_MAX);
+    for (size_t i = 0; i < count; i++)
+    {
+        guint8 *entry = data + i * SOURCE_CAPTURE_TIME_LEN;
+        uint32_t ssrc = capture_times[i].ssrc;
+        entry[0] = ssrc >> 24;
+        entry[1] = ssrc >> 16;
+        entry[2] = ssrc >> 8;
+        entry[3] = ssrc;
+        capture_time_write(entry + 4, capture_times[i].capture_time);
+    }
+    return count > 0 && gst_rtp_buffer_add_extension_twobytes_header(rtp, 0, SOURCE_CAPTURE_TIMES_EXTENSION_ID, data, count * SOURCE_CAPTURE_TIME_LEN);
+}
+
+/**
+ * Parses the capture times carried by a mapped RTP packet, either the capture time of a source packet, attributed to the packet SSRC, or the source capture times of a composite packet. Returns false if there are none.
+ */
+inline bool rtp_capture_times_parse(GstRTPBuffer *rtp, std::vector<source_capture_time> &capture_times)
+{
+    gpointer data;
+    guint size;
+    guint8 appbits;
+    capture_times.clear();
+    if (gst_rtp_buffer_get_extension_onebyte_header(rtp, CAPTURE_TIME_EXTENSION_ID, 0, &data, &size) && size >= 8)
+    {
+        capture_times.push_back({gst_rtp_buffer_get_ssrc(rtp), capture_time_read((const guint8 *)data)});
+    }
+    else if (gst_rtp_buffer_get_extension_twobytes_header(rtp, &appbits, SOURCE_CAPTURE_TIMES_EXTENSION_ID, 0, &data, &size))
+    {
+        for (guint offset = 0; offset + SOURCE_CAPTURE_TIME_LEN <= size; offset += SOURCE_CAPTURE_TIME_LEN)
+        {
+            const guint8 *entry = (const guint8 *)data + offset;
+            uint32_t ssrc = ((uint32_t)entry[0] << 24) | (entry[1] << 16) | (entry[2] << 8) | entry[3];
+            capture_times.push_back({ssrc, capture_time_read(entry + 4)});
+        }
+    }
+    return !capture_times.empty();
+}
+
+/**
+ * Appends to a list ordered by key, dropping the oldest entry beyond FRAME_TIMINGS_MAX.
+ */
+template <typename Key, typename Value>
+void frame_timings_push(std::deque<std::pair<Key, Value>> &list, Key key, Value value)
+{
+    list.emplace_back(key, std::move(value));
+    if (list.size() > FRAME_TIMINGS_MAX)
+    {
+        list.pop_front();
+    }
+}
+
+/**
+ * Looks up the entry of a list by key, newest first.
+ */
+template <typename Key, typename Value>
+bool frame_timings_find(const std::deque<std::pair<Key, Value>> &list, Key key, Value &value)
+{
+    for (auto entry = list.rbegin(); entry != list.rend(); entry++)
+    {
+        if (entry->first == key)
+        {
+            value = entry->second;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Modifies each buffer of a buffer or buffer list probe, after making it writable.
+ */
+template <typename Modify>
+void probe_buffers_modify(GstPadProbeInfo *info, Modify modify)
+{
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER)
+    {
+        GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+        modify(buffer);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    else if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    {
+        GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+        for (guint i = 0; i < gst_buffer_list_length(list); i++)
+        {
+            modify(gst_buffer_list_get_writable(list, i));
+        }
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+    }
+}
+
+/**
+ * Parses the capture times of the RTP packets entering a depayloader. The server also looks up the arrival time of the frame.
+ */
+inline GstPadProbeReturn depay_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto &timings = *(frame_timings *)user_data;
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(GST_PAD_PROBE_INFO_BUFFER(info), GST_MAP_READ, &rtp))
+        return GST_PAD_PROBE_OK;
+
+    uint32_t timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+    frame_timing timing;
+    bool has_timing = rtp_capture_times_parse(&rtp, timing.capture_times);
+    gst_rtp_buffer_unmap(&rtp);
+
+    std::lock_guard<std::mutex> lock(timings.mutex);
+    timings.last_timestamp = timestamp;
+    if (has_timing)
+    {
+        frame_timings_find(timings.ingress_times, timestamp, timing.ingress_time);
+        timings.pending = std::move(timing);
+        timings.pending_timestamp = timestamp;
+        timings.has_pending = true;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Keeps the timing of each frame leaving a depayloader by its PTS, if the frame carried one. Depayloaders push a frame while handling its last packet, so the pending timing belongs to it when its RTP timestamp is the latest one.
+ */
+inline GstPadProbeReturn depay_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto &timings = *(frame_timings *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    std::lock_guard<std::mutex> lock(timings.mutex);
+    if (timings.has_pending && timings.pending_timestamp == timings.last_timestamp)
+    {
+        frame_timings_push(timings.frames, pts, timings.pending);
+        timings.has_pending = false;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Tracks the timing of the frames passing through a depayloader in the given frame timings, which must outlive the depayloader.
+ */
+inline void frame_timings_attach(GstElement *rtph264depay, frame_timings *timings)
+{
+    GstPad *sink_pad = gst_element_get_static_pad(rtph264depay, "sink");
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, depay_sink_probe, timings, nullptr);
+    gst_object_unref(sink_pad);
+    GstPad *src_pad = gst_element_get_static_pad(rtph264depay, "src");
+    gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, depay_src_probe, timings, nullptr);
+    gst_object_unref(src_pad);
+}
@@ -0,0 +1,793 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Harry Nakos <xnakos@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include <arpa/inet.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "latency.h"
+#include "protocol.h"
+
+const int BUFFER_SIZE = 4096;
+
+// Frame interval of the recordings, in microseconds, and its RTP timestamp increment (90 kHz clock), at the frame rate configured by the server
+gint64 frame_interval = 1000000 / 30;
+uint32_t frame_timestamp_increment = 90000 / 30;
+
+// Encoder bitrate per pixel of each frame, in bits, as in the capture pipeline of the client: 500 kbit/s at 320x240 and 30 fps
+const double CAPTURE_BITS_PER_PIXEL = 500000.0 / (320 * 240 * 30);
+
+// Length of the recordings, in seconds, looped
+const int RECORDING_DURATION = 10;
+
+// One-byte header extension carrying the capture time: 4-byte extension header, element header, 8-byte capture time, 3 bytes of padding
+const size_t CAPTURE_TIME_EXTENSION_LEN = 16;
+
+/**
+ * Pre-encoded video, as the RTP packets of each frame, replayed by all simulated source clients instead of running an encoder per client.
+ */
+typedef std::vector<std::vector<std::vector<char>>> recording;
+
+// Recordings by size, encoded at the cell size of the server config, and at each cell size the server asks sources to encode at afterwards
+std::map<std::pair<uint16_t, uint16_t>, recording> recordings;
+
+// SSRCs of the source frames whose capture times clients received, i.e. of the sources the server composited or forwarded
+std::set<uint32_t> received_source_ssrcs;
+
+// Samples kept per client for each latency percentile, so that memory stays bounded however long the run
+const size_t RESERVOIR_SIZE = 4096;
+
+/**
+ * Uniform sample of a stream of values, kept by reservoir sampling.
+ */
+struct sample_reservoir
+{
+    std::vector<gint64> samples;
+    uint64_t count = 0;
+    std::minstd_rand random_engine;
+};
+
+void reservoir_add(sample_reservoir &reservoir, gint64 value)
+{
+    reservoir.count++;
+    if (reservoir.samples.size() < RESERVOIR_SIZE)
+    {
+        reservoir.samples.push_back(value);
+        return;
+    }
+    // Each value of the stream ends up in the sample with the same probability
+    uint64_t ix = reservoir.random_engine() % reservoir.count;
+    if (ix < RESERVOIR_SIZE)
+    {
+        reservoir.samples[ix] = value;
+    }
+}
+
+/**
+ * Reception state of one RTP stream (SSRC) received by a simulated client.
+ */
+struct stream_state
+{
+    uint16_t last_seq;
+    // Transit time (arrival time minus RTP time, both in microseconds) of the previous packet, and its minimum, which approximates the propagation delay
+    gint64 transit;
+    gint64 transit_min;
+};
+
+/**
+ * A simulated client, with its own socket, so that the server sees it as a distinct client.
+ */
+struct sim_client
+{
+    int sock;
+    bool is_source;
+
+    // Source replay state: the recording at the cell size of the client, the next frame to send, when to send it, and the rewritten RTP header fields
+    const recording *frames = nullptr;
+    size_t frame_ix = 0;
+    gint64 frame_time = 0;
+    uint32_t ssrc = 0;
+    uint16_t seq = 0;
+    uint32_t timestamp = 0;
+
+    std::map<uint32_t, stream_state> streams;
+
+    // Totals, and interval counts since the previous report
+    uint64_t sent_packets = 0;
+    uint64_t received_packets = 0;
+    uint64_t lost_packets = 0;
+    uint64_t interval_received_packets = 0;
+    uint64_t interval_lost_packets = 0;
+    uint64_t interval_received_bytes = 0;
+    // Video frames received, counted by their last packet (RTP marker bit), FEC packets aside
+    uint64_t received_frames = 0;
+
+    // Time from the first join message to the first keyframe received, -1 before it arrives
+    gint64 join_time = 0;
+    gint64 keyframe_latency = -1;
+
+    // Interarrival jitter, as in RFC 3550, in microseconds
+    double jitter = 0;
+    // Queueing delay samples, i.e. transit time above its minimum, in microseconds
+    sample_reservoir queueing_delays;
+    // Capture to reception latency samples of the source frames received, in microseconds
+    sample_reservoir capture_latencies;
+};
+
+/**
+ * Encodes a test pattern once, at the given size and frame rate, into frames. The recording starts with a keyframe, so replay can restart from its beginning whenever the server asks for a keyframe.
+ */
+bool recording_make(recording &frames, uint16_t width, uint16_t height, int framerate, int bitrate)
+{
+    GstElement *pipeline = gst_pipeline_new("recording-pipeline");
+    GstElement *videotestsrc = gst_element_factory_make("videotestsrc", "videotestsrc");
+    GstElement *capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
+    GstElement *x264enc = gst_element_factory_make("x264enc", "x264enc");
+    GstElement *rtph264pay = gst_element_factory_make("rtph264pay", "rtph264pay");
+    GstElement *appsink = gst_element_factory_make("appsink", "appsink");
+
+    if (!pipeline || !videotestsrc || !capsfilter || !x264enc || !rtph264pay || !appsink)
+    {
+        g_printerr("Failed to create recording pipeline elements.\n");
+        return false;
+    }
+
+    // pattern: ball (18) – Moving ball
+    g_object_set(videotestsrc, "pattern", 18, "num-buffers", RECORDING_DURATION * framerate, nullptr);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "framerate", GST_TYPE_FRACTION, framerate, 1,
+                                        "width", G_TYPE_INT, (int)width,
+                                        "height", G_TYPE_INT, (int)height,
+                                        nullptr);
+    g_object_set(capsfilter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+    // Same encoder settings as the capture pipeline of the client
+    g_object_set(x264enc, "tune", 4, "bitrate", bitrate, "speed-preset", 2, nullptr);
+    g_object_set(rtph264pay, "config-interval", -1, nullptr);
+    g_object_set(appsink, "sync", FALSE, nullptr);
+
+    gst_bin_add_many(GST_BIN(pipeline), videotestsrc, capsfilter, x264enc, rtph264pay, appsink, nullptr);
+    if (!gst_element_link_many(videotestsrc, capsfilter, x264enc, rtph264pay, appsink, nullptr))
+    {
+        g_printerr("Failed to link recording pipeline elements.\n");
+        gst_object_unref(pipeline);
+        return false;
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    // Packets of the same frame share the RTP timestamp
+    bool has_packet = false;
+    uint32_t last_timestamp = 0;
+    GstSample *sample;
+    while ((sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) != nullptr)
+    {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        GstMapInfo map;
+        if (gst_buffer_map(buffer, &map, GST_MAP_READ))
+        {
+            if (map.size >= 12)
+            {
+                uint32_t timestamp;
+                memcpy(&timestamp, map.data + 4, 4);
+                if (!has_packet || timestamp != last_timestamp)
+                {
+                    frames.emplace_back();
+                }
+                has_packet = true;
+                last_timestamp = timestamp;
+                frames.back().emplace_back((char *)map.data, (char *)map.data + map.size);
+            }
+            gst_buffer_unmap(buffer, &map);
+        }
+        gst_sample_unref(sample);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    return !frames.empty();
+}
+
+/**
+ * Returns the recording of the given size, encoding it on first use, or nullptr if it cannot be encoded. A bitrate of 0 is derived from the size and frame rate, as the client does.
+ */
+const recording *recording_get(uint16_t width, uint16_t height, int framerate, int bitrate)
+{
+    auto key = std::make_pair(width, height);
+    auto recording_it = recordings.find(key);
+    if (recording_it != recordings.end())
+        return &recording_it->second;
+
+    if (bitrate == 0)
+    {
+        bitrate = std::max(50, (int)(CAPTURE_BITS_PER_PIXEL * width * height * framerate / 1000));
+    }
+    std::cout << "Encoding the recording at " << width << "x" << height << ", " << framerate << " fps and " << bitrate << " kbit/s." << std::endl;
+    recording frames;
+    if (!recording_make(frames, width, height, framerate, bitrate))
+    {
+        g_printerr("Failed to encode the recording.\n");
+        return nullptr;
+    }
+    return &(recordings[key] = std::move(frames));
+}
+
+/**
+ * Waits for the server configuration, sent in reply to join messages, as the client does. Joins every second meanwhile. Other packets received are discarded. Returns false on timeout.
+ */
+bool server_config_wait(int sock, const std::string &room_name, uint8_t rendition, server_config &config)
+{
+    char message[CONTROL_JOIN_MAX_LEN];
+    size_t message_len = control_join_make(message, room_name, rendition);
+    char buffer[BUFFER_SIZE];
+    gint64 deadline = g_get_monotonic_time() + 5000000;
+    gint64 join_time = 0;
+
+    while (true)
+    {
+        gint64 current_time = g_get_monotonic_time();
+        if (current_time >= deadline)
+            return false;
+        if (current_time >= join_time)
+        {
+            send(sock, message, message_len, 0);
+            join_time = current_time + 1000000;
+        }
+
+        pollfd fd{sock, POLLIN, 0};
+        if (poll(&fd, 1, (std::min(deadline, join_time) - current_time + 999) / 1000) <= 0)
+            continue;
+
+        ssize_t len = recv(sock, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+        if (len > 0 && control_message_is(buffer, len) && control_message_type(buffer) == CONTROL_CONFIG && control_config_parse(buffer, len, config))
+            return true;
+    }
+}
+
+int sim_client_sock_make(const sockaddr_in &server_sockaddr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        std::cerr << "Failed to create socket." << std::endl;
+        return -1;
+    }
+
+    int buffer_size = 1 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    if (connect(sock, (struct sockaddr *)&server_sockaddr, sizeof(server_sockaddr)) < 0)
+    {
+        std::cerr << "Failed to connect socket." << std::endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Sends the next recording frame of a source client, with the SSRC, sequence numbers and timestamp of its own stream.
+ */
+void sim_client_send_frame(sim_client &client)
+{
+    // Loop the recording from its starting keyframe
+    if (client.frame_ix >= client.frames->size())
+    {
+        client.frame_ix = 0;
+    }
+
+    gint64 capture_time = g_get_real_time();
+
+    for (const auto &packet : (*client.frames)[client.frame_ix])
+    {
+        // The capture time extension goes between the fixed header, without CSRCs or extension, and the payload
+        char data[BUFFER_SIZE];
+        size_t len = packet.size();
+        if (len < 12 || ((uint8_t)packet[0] & 0x1f) != 0 || len + CAPTURE_TIME_EXTENSION_LEN > BUFFER_SIZE)
+            continue;
+        memcpy(data, packet.data(), 12);
+        memcpy(data + 12 + CAPTURE_TIME_EXTENSION_LEN, packet.data() + 12, len - 12);
+        len += CAPTURE_TIME_EXTENSION_LEN;
+
+        uint8_t *extension = (uint8_t *)data + 12;
+        data[0] |= 0x10;
+        // Profile 0xBEDE (one-byte header), length in 32-bit words
+        extension[0] = 0xbe;
+        extension[1] = 0xde;
+        extension[2] = 0;
+        extension[3] = 3;
+        // ID and length minus 1
+        extension[4] = (CAPTURE_TIME_EXTENSION_ID << 4) | 7;
+        capture_time_write(extension + 5, capture_time);
+        memset(extension + 13, 0, 3);
+
+        uint16_t seq = htons(client.seq++);
+        uint32_t timestamp = htonl(client.timestamp);
+        uint32_t ssrc = htonl(client.ssrc);
+        memcpy(data + 2, &seq, 2);
+        memcpy(data + 4, &timestamp, 4);
+        memcpy(data + 8, &ssrc, 4);
+
+        if (send(client.sock, data, len, 0) < 0)
+        {
+            std::cerr << "Failed to send video data." << std::endl;
+            break;
+        }
+        client.sent_packets++;
+    }
+
+    client.frame_ix++;
+    client.timestamp += frame_timestamp_increment;
+    client.frame_time += frame_interval;
+}
+
+/**
+ * Switches a source client to the recording of the cell size the server asks for, from its starting keyframe, as the client rescales its capture. Encoding a recording of a new size holds up all sources, so their frames are delayed by as long, rather than sent in a burst afterwards.
+ */
+void sim_client_cell_set(std::vector<sim_client> &clients, sim_client &client, uint16_t width, uint16_t height, int framerate, int bitrate)
+{
+    gint64 start_time = g_get_monotonic_time();
+    const recording *frames = recording_get(width, height, framerate, bitrate);
+    if (!frames || frames == client.frames)
+        return;
+
+    client.frames = frames;
+    client.frame_ix = 0;
+    gint64 encoding_time = g_get_monotonic_time() - start_time;
+    for (auto &other : clients)
+    {
+        other.frame_time += encoding_time;
+    }
+}
+
+/**
+ * Reads the capture times carried by an RTP packet, with the parser of the clients: the source capture times of the first packet of a composite frame, or, in SFU mode, the capture time of the last packet of a source frame, attributed to the packet SSRC, so that each source frame is counted once.
+ */
+void rtp_capture_times_read(const char *data, size_t len, std::vector<source_capture_time> &capture_times)
+{
+    capture_times.clear();
+    // Most packets carry no header extension
+    if (!((uint8_t)data[0] & 0x10))
+        return;
+
+    GstBuffer *buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (gpointer)data, len, 0, len, nullptr, nullptr);
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+    {
+        gpointer extension_data;
+        guint extension_size;
+        bool is_source_packet = gst_rtp_buffer_get_extension_onebyte_header(&rtp, CAPTURE_TIME_EXTENSION_ID, 0, &extension_data, &extension_size);
+        if (!is_source_packet || gst_rtp_buffer_get_marker(&rtp))
+        {
+            rtp_capture_times_parse(&rtp, capture_times);
+        }
+        gst_rtp_buffer_unmap(&rtp);
+    }
+    gst_buffer_unref(buffer);
+}
+
+/**
+ * Accounts for an RTP packet received by a client: loss from sequence number gaps, and delay from the transit time of the packet, per SSRC.
+ */
+void sim_client_receive(sim_client &client, const char *data, size_t len, gint64 current_time)
+{
+    // RTP version 2 header
+    if (len < 12 || ((uint8_t)data[0] >> 6) != 2)
+        return;
+
+    uint16_t seq = ((uint8_t)data[2] << 8) | (uint8_t)data[3];
+    uint32_t timestamp;
+    uint32_t ssrc;
+    memcpy(&timestamp, data + 4, 4);
+    memcpy(&ssrc, data + 8, 4);
+    timestamp = ntohl(timestamp);
+    ssrc = ntohl(ssrc);
+
+    client.received_packets++;
+    client.interval_received_packets++;
+    client.interval_received_bytes += len;
+    if (((uint8_t)data[1] & 0x80) && ((uint8_t)data[1] & 0x7f) != FEC_PAYLOAD_TYPE)
+    {
+        client.received_frames++;
+    }
+
+    if (client.keyframe_latency == -1 && rtp_h264_keyframe_starts(data, len))
+    {
+        client.keyframe_latency = current_time - client.join_time;
+    }
+
+    // All simulated clients share the wall clock, so capture times of any source are accurate
+    std::vector<source_capture_time> capture_times;
+    rtp_capture_times_read(data, len, capture_times);
+    gint64 real_time = g_get_real_time();
+    for (const auto &capture_time : capture_times)
+    {
+        reservoir_add(client.capture_latencies, real_time - capture_time.capture_time);
+        received_source_ssrcs.insert(capture_time.ssrc);
+    }
+
+    // RTP time in microseconds, wrapping along with the 32-bit timestamp
+    gint64 transit = current_time - (gint64)timestamp * 1000 / 90;
+
+    auto stream = client.streams.find(ssrc);
+    if (stream == client.streams.end())
+    {
+        client.streams[ssrc] = stream_state{seq, transit, transit};
+        return;
+    }
+
+    auto &state = stream->second;
+
+    // Packets arriving out of order (seq_delta beyond half the sequence space) are not counted as losses
+    uint16_t seq_delta = seq - state.last_seq;
+    if (seq_delta > 0 && seq_delta < 0x8000)
+    {
+        client.lost_packets += seq_delta - 1;
+        client.interval_lost_packets += seq_delta - 1;
+        state.last_seq = seq;
+    }
+
+    // A timestamp wrap shows up as a transit jump of about 13 hours, which restarts the stream state
+    if (std::abs(transit - state.transit) > 10000000)
+    {
+        state.transit = transit;
+        state.transit_min = transit;
+        return;
+    }
+
+    client.jitter += (std::abs(transit - state.transit) - client.jitter) / 16;
+    state.transit = transit;
+    state.transit_min = std::min(state.transit_min, transit);
+    reservoir_add(client.queueing_delays, transit - state.transit_min);
+}
+
+/**
+ * Sends the join message, which also keeps the client active, and a receiver report for the last interval.
+ */
+void sim_client_keep_alive(sim_client &client, const std::string &room_name, uint8_t rendition, gint64 interval)
+{
+    char message[CONTROL_JOIN_MAX_LEN];
+    size_t message_len = control_join_make(message, room_name, rendition);
+    if (send(client.sock, message, message_len, 0) < 0)
+    {
+        std::cerr << "Failed to send keepalive message." << std::endl;
+    }
+
+    uint64_t expected_packets = client.interval_received_packets + client.interval_lost_packets;
+    if (expected_packets > 0)
+    {
+        receiver_report report;
+        report.loss_permille = client.interval_lost_packets * 1000 / expected_packets;
+        report.jitter_ms = client.jitter / 1000;
+        report.rate_kbps = client.interval_received_bytes * 8 * 1000 / std::max<gint64>(interval, 1);
+        char report_message[CONTROL_REPORT_LEN];
+        size_t report_message_len = control_report_make(report_message, report);
+        if (send(client.sock, report_message, report_message_len, 0) < 0)
+        {
+            std::cerr << "Failed to send report message." << std::endl;
+        }
+    }
+}
+
+/**
+ * Reads the CPU time of a process from /proc, in clock ticks, or returns -1 if it is not available.
+ */
+long process_cpu_ticks(int pid)
+{
+    std::string path = "/proc/" + std::to_string(pid) + "/stat";
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+        return -1;
+
+    char line[1024];
+    bool is_read = fgets(line, sizeof(line), file) != nullptr;
+    fclose(file);
+    if (!is_read)
+        return -1;
+
+    // The process name may contain spaces, so fields are counted from its closing parenthesis. utime and stime are fields 14 and 15.
+    const char *fields = strrchr(line, ')');
+    unsigned long utime;
+    unsigned long stime;
+    if (fields == nullptr || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return utime + stime;
+}
+
+gint64 percentile(sample_reservoir &reservoir, double p)
+{
+    auto &values = reservoir.samples;
+    if (values.empty())
+        return 0;
+    size_t ix = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + ix, values.end());
+    return values[ix];
+}
+
+void print_usage(char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-n sources] [-k sinks] [-j room] [-q rendition] [-b bitrate] [-d seconds] [-P serverpid] [-p serverport] [serverhost]\n", program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t source_count = 4;
+    size_t sink_count = 4;
+    std::string room_name = "";
+    uint8_t rendition = 0;
+    // Encoder bitrate, in kbit/s, 0 for deriving it from the cell size and frame rate
+    int bitrate = 0;
+    // Run time, 0 for running until interrupted
+    int duration = 0;
+    // Server process ID, for CPU usage, 0 for none
+    int server_pid = 0;
+    std::string server_host = "127.0.0.1";
+    int server_port = 27884;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:j:q:b:d:P:p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            source_count = std::max(0, atoi(optarg));
+            break;
+        case 'k':
+            sink_count = std::max(0, atoi(optarg));
+            break;
+        case 'j':
+            room_name = optarg;
+            break;
+        case 'q':
+            rendition = atoi(optarg);
+            break;
+        case 'b':
+            bitrate = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            duration = std::max(0, atoi(optarg));
+            break;
+        case 'P':
+            server_pid = atoi(optarg);
+            break;
+        case 'p':
+            server_port = atoi(optarg);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc)
+    {
+        server_host = argv[optind];
+    }
+
+    gst_init(&argc, &argv);
+
+    sockaddr_in server_sockaddr;
+    memset(&server_sockaddr, 0, sizeof(server_sockaddr));
+    server_sockaddr.sin_family = AF_INET;
+    server_sockaddr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_host.c_str(), &server_sockaddr.sin_addr) != 1)
+    {
+        std::cerr << "Invalid server host, expected an IPv4 address." << std::endl;
+        return 1;
+    }
+
+    std::mt19937 random_engine(std::random_device{}());
+    gint64 current_time = g_get_monotonic_time();
+
+    std::vector<sim_client> clients(source_count + sink_count);
+    std::vector<pollfd> fds(clients.size());
+    for (auto &client : clients)
+    {
+        client.sock = sim_client_sock_make(server_sockaddr);
+        if (client.sock < 0)
+            return 1;
+    }
+
+    // The recording is encoded at the cell size and frame rate the server configures, as clients capture at
+    server_config config{SERVER_MODE_COMPOSITE};
+    if (!clients.empty() && !server_config_wait(clients[0].sock, room_name, rendition, config))
+    {
+        std::cerr << "No config received from server, assuming defaults." << std::endl;
+    }
+    frame_interval = 1000000 / config.framerate;
+    frame_timestamp_increment = 90000 / config.framerate;
+    const recording *frames = recording_get(config.cell_width, config.cell_height, config.framerate, bitrate);
+    if (!frames)
+        return 1;
+    current_time = g_get_monotonic_time();
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        auto &client = clients[i];
+        client.is_source = i < source_count;
+        client.frames = frames;
+        client.ssrc = random_engine();
+        client.seq = random_engine();
+        client.timestamp = random_engine();
+        // Sources are staggered over a frame interval, as independent clients would be
+        client.frame_time = current_time + frame_interval * i / std::max<size_t>(source_count, 1);
+        client.join_time = current_time;
+        fds[i] = pollfd{client.sock, POLLIN, 0};
+
+        sim_client_keep_alive(client, room_name, rendition, 1000000);
+    }
+
+    std::cout << "Simulating " << source_count << " source clients and " << sink_count << " sink clients, replaying " << frames->size() << " frames." << std::endl;
+
+    gint64 start_time = current_time;
+    gint64 report_time = current_time;
+    long server_cpu_ticks = server_pid > 0 ? process_cpu_ticks(server_pid) : -1;
+    uint64_t report_sent_packets = 0;
+    uint64_t report_received_packets = 0;
+    uint64_t report_lost_packets = 0;
+    uint64_t report_received_frames = 0;
+
+    char buffer[BUFFER_SIZE];
+
+    while (duration == 0 || current_time - start_time < (gint64)duration * 1000000)
+    {
+        // Wait for packets until the next frame is due, or the next report
+        gint64 next_time = report_time + 1000000;
+        for (size_t i = 0; i < source_count; i++)
+        {
+            next_time = std::min(next_time, clients[i].frame_time);
+        }
+        int timeout = std::max<gint64>(0, (next_time - current_time + 999) / 1000);
+
+        if (poll(fds.data(), fds.size(), timeout) < 0)
+        {
+            std::cerr << "Failed to poll." << std::endl;
+            break;
+        }
+
+        current_time = g_get_monotonic_time();
+
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+
+            auto &client = clients[i];
+            ssize_t len;
+            while ((len = recv(client.sock, buffer, BUFFER_SIZE, MSG_DONTWAIT)) > 0)
+            {
+                if (control_message_is(buffer, len))
+                {
+                    // Replay restarts from the keyframe the recording starts with
+                    if (control_message_type(buffer) == CONTROL_KEYFRAME && client.is_source)
+                    {
+                        client.frame_ix = 0;
+                    }
+                    uint16_t cell_width;
+                    uint16_t cell_height;
+                    if (control_message_type(buffer) == CONTROL_CELL && client.is_source && control_cell_parse(buffer, len, cell_width, cell_height))
+                    {
+                        sim_client_cell_set(clients, client, cell_width, cell_height, config.framerate, bitrate);
+                        current_time = g_get_monotonic_time();
+                    }
+                    continue;
+                }
+                sim_client_receive(client, buffer, len, current_time);
+            }
+        }
+
+        for (size_t i = 0; i < source_count; i++)
+        {
+            while (clients[i].frame_time <= current_time)
+            {
+                sim_client_send_frame(clients[i]);
+            }
+        }
+
+        if (current_time - report_time < 1000000)
+            continue;
+
+        gint64 interval = current_time - report_time;
+        report_time = current_time;
+
+        uint64_t sent_packets = 0;
+        uint64_t received_packets = 0;
+        uint64_t lost_packets = 0;
+        uint64_t received_frames = 0;
+        double jitter = 0;
+        for (auto &client : clients)
+        {
+            sim_client_keep_alive(client, room_name, rendition, interval);
+            sent_packets += client.sent_packets;
+            received_packets += client.received_packets;
+            lost_packets += client.lost_packets;
+            received_frames += client.received_frames;
+            jitter += client.jitter;
+            client.interval_received_packets = 0;
+            client.interval_lost_packets = 0;
+            client.interval_received_bytes = 0;
+        }
+
+        uint64_t interval_received_packets = received_packets - report_received_packets;
+        uint64_t interval_lost_packets = lost_packets - report_lost_packets;
+        std::cout << "Sent " << (sent_packets - report_sent_packets) * 1000000 / interval << " packets/s, ";
+        std::cout << "received " << interval_received_packets * 1000000 / interval << " packets/s, ";
+        std::cout << "loss " << (interval_received_packets + interval_lost_packets > 0 ? 100.0 * interval_lost_packets / (interval_received_packets + interval_lost_packets) : 0.0) << "%, ";
+        std::cout << "jitter " << (clients.empty() ? 0.0 : jitter / clients.size() / 1000) << " ms, ";
+        // Every client receives the composite, so this is the composite frame rate, or, in SFU mode, the sum of the frame rates of the forwarded sources
+        std::cout << "frame rate " << (clients.empty() ? 0.0 : (double)(received_frames - report_received_frames) * 1000000 / interval / clients.size()) << " fps";
+        if (server_cpu_ticks >= 0)
+        {
+            long ticks = process_cpu_ticks(server_pid);
+            if (ticks >= 0)
+            {
+                std::cout << ", server CPU " << 100.0 * (ticks - server_cpu_ticks) / sysconf(_SC_CLK_TCK) * 1000000 / interval << "%";
+                server_cpu_ticks = ticks;
+            }
+        }
+        std::cout << std::endl;
+
+        report_sent_packets = sent_packets;
+        report_received_packets = received_packets;
+        report_lost_packets = lost_packets;
+        report_received_frames = received_frames;
+    }
+
+    // Per-client summary. The startup latency covers joining, the server keyframe and the path back. The capture latency is from sending a source frame to receiving the frame that composites it (without decoding it). The queueing delay is the transit time above its minimum, i.e. the latency added by queues on top of the fastest packet.
+    std::cout << "---- Clients ----" << std::endl;
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        auto &client = clients[i];
+        uint64_t expected_packets = client.received_packets + client.lost_packets;
+        std::cout << (client.is_source ? "source " : "sink ") << i << ": ";
+        std::cout << "received " << client.received_packets << " packets, ";
+        std::cout << "frame rate " << (current_time > start_time ? (double)client.received_frames * 1000000 / (current_time - start_time) : 0.0) << " fps, ";
+        std::cout << "loss " << (expected_packets > 0 ? 100.0 * client.lost_packets / expected_packets : 0.0) << "%, ";
+        std::cout << "startup latency " << (client.keyframe_latency >= 0 ? client.keyframe_latency / 1000.0 : -1.0) << " ms, ";
+        std::cout << "capture latency p50 " << percentile(client.capture_latencies, 0.5) / 1000.0 << " ms, ";
+        std::cout << "p95 " << percentile(client.capture_latencies, 0.95) / 1000.0 << " ms, ";
+        std::cout << "queueing delay p50 " << percentile(client.queueing_delays, 0.5) / 1000.0 << " ms, ";
+        std::cout << "p95 " << percentile(client.queueing_delays, 0.95) / 1000.0 << " ms, ";
+        std::cout << "jitter " << client.jitter / 1000 << " ms" << std::endl;
+        close(client.sock);
+    }
+    std::cout << "-----------------" << std::endl;
+
+    // Sources the server did not decode (or forward) leave the load on the server short of what was asked for
+    size_t received_source_count = 0;
+    for (size_t i = 0; i < source_count; i++)
+    {
+        received_source_count += received_source_ssrcs.count(clients[i].ssrc);
+    }
+    std::cout << "Sources received back: " << received_source_count << " of " << source_count << "." << std::endl;
+    if (received_source_ssrcs.empty() && source_count > 0)
+    {
+        std::cerr << "No capture times received; in composite mode, the server only sends them with -L." << std::endl;
+    }
+    else if (received_source_count < source_count)
+    {
+        std::cerr << "Some sources never reached the sink clients; sources beyond the maximum number of sources of the server stay hidden." << std::endl;
+    }
+
+    return 0;
+}
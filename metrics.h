@@ -0,0 +1,140 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Harry Nakos <xnakos@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Histogram bucket upper bounds, in microseconds, from 10 µs to 100 ms, plus +Inf
+const int64_t HISTOGRAM_BOUNDS[] = {10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000};
+const size_t HISTOGRAM_BOUND_COUNT = sizeof(HISTOGRAM_BOUNDS) / sizeof(HISTOGRAM_BOUNDS[0]);
+
+/**
+ * Duration histogram, updated by one thread and read by the metrics endpoint. Bucket counts are not cumulative until rendered.
+ */
+struct histogram
+{
+    std::atomic<uint64_t> buckets[HISTOGRAM_BOUND_COUNT + 1] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+};
+
+inline void histogram_observe(histogram &h, int64_t duration)
+{
+    size_t ix = 0;
+    while (ix < HISTOGRAM_BOUND_COUNT && duration > HISTOGRAM_BOUNDS[ix])
+    {
+        ix++;
+    }
+    // Relaxed ordering: each histogram has a single writer, and readers only need eventually consistent values
+    h.buckets[ix].fetch_add(1, std::memory_order_relaxed);
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.sum.fetch_add(duration, std::memory_order_relaxed);
+}
+
+inline void counter_add(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+/**
+ * Appends the HELP and TYPE lines of a metric, in the Prometheus text exposition format.
+ */
+inline void metric_header_render(std::string &out, const std::string &name, const std::string &type, const std::string &help)
+{
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+}
+
+inline void metric_sample_render(std::string &out, const std::string &name, const std::string &labels, double value)
+{
+    out += name + "{" + labels + "} " + std::to_string(value) + "\n";
+}
+
+/**
+ * Appends the samples of a histogram, with durations in seconds.
+ */
+inline void histogram_render(std::string &out, const std::string &name, const std::string &labels, const histogram &h)
+{
+    uint64_t cumulative_count = 0;
+    for (size_t ix = 0; ix <= HISTOGRAM_BOUND_COUNT; ix++)
+    {
+        cumulative_count += h.buckets[ix].load(std::memory_order_relaxed);
+        std::string le = ix < HISTOGRAM_BOUND_COUNT ? std::to_string(HISTOGRAM_BOUNDS[ix] / 1e6) : "+Inf";
+        out += name + "_bucket{" + labels + ",le=\"" + le + "\"} " + std::to_string(cumulative_count) + "\n";
+    }
+    out += name + "_sum{" + labels + "} " + std::to_string(h.sum.load(std::memory_order_relaxed) / 1e6) + "\n";
+    out += name + "_count{" + labels + "} " + std::to_string(h.count.load(std::memory_order_relaxed)) + "\n";
+}
+
+/**
+ * Serves the metrics rendered on each request over HTTP on the loopback interface, from a detached thread. Requests are not parsed: any request on any path gets the metrics. A connection that stalls for over a second is dropped, so that it cannot hold up the following ones. Returns false if the port cannot be bound.
+ */
+inline bool metrics_serve(int port, std::function<std::string()> render)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        std::cerr << "Failed to create metrics socket." << std::endl;
+        return false;
+    }
+
+    int reuseaddr = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr));
+
+    sockaddr_in sockaddr{};
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0 || listen(sock, 4) < 0)
+    {
+        std::cerr << "Failed to bind metrics socket." << std::endl;
+        close(sock);
+        return false;
+    }
+
+    std::thread([sock, render]()
+                {
+                    char request[1024];
+                    while (true)
+                    {
+                        int conn = accept(sock, nullptr, nullptr);
+                        if (conn < 0)
+                        {
+                            continue;
+                        }
+                        timeval timeout{1, 0};
+                        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                        // Read the request head, ignoring its content
+                        if (recv(conn, request, sizeof(request), 0) >= 0)
+                        {
+                            std::string body = render();
+                            std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+                            size_t sent = 0;
+                            while (sent < response.size())
+                            {
+                                ssize_t len = send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                                if (len <= 0)
+                                {
+                                    break;
+                                }
+                                sent += len;
+                            }
+                        }
+                        close(conn);
+                    } })
+        .detach();
+    return true;
+}
@@ -0,0 +1,277 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Harry Nakos <xnakos@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Control messages are sent over the same UDP sockets as RTP packets. RTP version 2 packets always start with the bits 10, so control messages start with a byte whose top bits differ.
+const uint8_t CONTROL_MAGIC = 0x41;
+
+// RTP payload type of ULPFEC packets, sent in the same stream as the H.264 packets (payload type 96)
+const uint8_t FEC_PAYLOAD_TYPE = 122;
+
+/**
+ * Checks whether an RTP packet starts an H.264 keyframe, i.e. carries an SPS or the start of an IDR slice, either as a single NAL unit, in a STAP-A aggregation or as the first FU-A fragment.
+ */
+inline bool rtp_h264_keyframe_starts(const char *data, size_t len)
+{
+    // RTP version 2 header, with the H.264 payload type
+    if (len < 12 || ((uint8_t)data[0] >> 6) != 2 || ((uint8_t)data[1] & 0x7f) == FEC_PAYLOAD_TYPE)
+        return false;
+
+    size_t offset = 12 + 4 * ((uint8_t)data[0] & 0x0f);
+    // Header extension: 4 bytes, then the extension length in 32-bit words
+    if ((uint8_t)data[0] & 0x10)
+    {
+        if (len < offset + 4)
+            return false;
+        offset += 4 + 4 * (((uint8_t)data[offset + 2] << 8) | (uint8_t)data[offset + 3]);
+    }
+    if (len <= offset)
+        return false;
+
+    const uint8_t *payload = (const uint8_t *)data + offset;
+    size_t payload_len = len - offset;
+    uint8_t nal_type = payload[0] & 0x1f;
+
+    // STAP-A: the first aggregated NAL unit header follows its 2-byte size
+    if (nal_type == 24 && payload_len > 3)
+    {
+        nal_type = payload[3] & 0x1f;
+    }
+    // FU-A: the FU header carries the start bit and the fragmented NAL unit type
+    else if (nal_type == 28 && payload_len > 1)
+    {
+        if (!(payload[1] & 0x80))
+            return false;
+        nal_type = payload[1] & 0x1f;
+    }
+
+    return nal_type == 5 || nal_type == 7;
+}
+
+// Control message types, in the second byte
+const uint8_t CONTROL_JOIN = 'J';
+const uint8_t CONTROL_REPORT = 'R';
+const uint8_t CONTROL_KEYFRAME = 'K';
+const uint8_t CONTROL_NACK = 'N';
+const uint8_t CONTROL_CONFIG = 'C';
+const uint8_t CONTROL_CELL = 'S';
+
+// Maximum room name length, in bytes
+const size_t ROOM_NAME_MAX_LEN = 64;
+
+// Size of the magic and type bytes
+const size_t CONTROL_HEADER_LEN = 2;
+
+// Maximum join message length
+const size_t CONTROL_JOIN_MAX_LEN = CONTROL_HEADER_LEN + 1 + ROOM_NAME_MAX_LEN;
+
+inline bool control_message_is(const char *data, size_t len)
+{
+    return len >= CONTROL_HEADER_LEN && (uint8_t)data[0] == CONTROL_MAGIC;
+}
+
+inline uint8_t control_message_type(const char *data)
+{
+    return (uint8_t)data[1];
+}
+
+/**
+ * Join message, sent by clients to become members of a room. It is sent periodically, so that it also serves as a keepalive message.
+ * Layout: magic, type, requested rendition index, room name (up to ROOM_NAME_MAX_LEN bytes, not null-terminated).
+ * Returns the message length. The data must have room for CONTROL_JOIN_MAX_LEN bytes.
+ */
+inline size_t control_join_make(char *data, const std::string &room_name, uint8_t rendition)
+{
+    size_t room_name_len = std::min(room_name.size(), ROOM_NAME_MAX_LEN);
+    data[0] = CONTROL_MAGIC;
+    data[1] = CONTROL_JOIN;
+    data[2] = rendition;
+    memcpy(data + CONTROL_HEADER_LEN + 1, room_name.data(), room_name_len);
+    return CONTROL_HEADER_LEN + 1 + room_name_len;
+}
+
+inline uint8_t control_join_rendition(const char *data, size_t len)
+{
+    return len > CONTROL_HEADER_LEN ? (uint8_t)data[2] : 0;
+}
+
+inline std::string control_join_room_name(const char *data, size_t len)
+{
+    if (len <= CONTROL_HEADER_LEN + 1)
+        return "";
+    return std::string(data + CONTROL_HEADER_LEN + 1, std::min(len - CONTROL_HEADER_LEN - 1, ROOM_NAME_MAX_LEN));
+}
+
+/**
+ * Keyframe request, sent by the server to a source client, which then makes its encoder emit a keyframe. The message has no body.
+ */
+inline size_t control_keyframe_make(char *data)
+{
+    data[0] = CONTROL_MAGIC;
+    data[1] = CONTROL_KEYFRAME;
+    return CONTROL_HEADER_LEN;
+}
+
+/**
+ * Receiver report, sent periodically by clients about the composite video they receive.
+ */
+struct receiver_report
+{
+    // Fraction of packets lost since the previous report, in permille
+    uint16_t loss_permille;
+    // Interarrival jitter, in milliseconds
+    uint16_t jitter_ms;
+    // Receive rate since the previous report, in kbit/s
+    uint32_t rate_kbps;
+};
+
+// Report message length: magic, type, then the report fields in network byte order
+const size_t CONTROL_REPORT_LEN = CONTROL_HEADER_LEN + 8;
+
+inline size_t control_report_make(char *data, const receiver_report &report)
+{
+    data[0] = CONTROL_MAGIC;
+    data[1] = CONTROL_REPORT;
+    uint16_t loss_permille = htons(report.loss_permille);
+    uint16_t jitter_ms = htons(report.jitter_ms);
+    uint32_t rate_kbps = htonl(report.rate_kbps);
+    memcpy(data + 2, &loss_permille, 2);
+    memcpy(data + 4, &jitter_ms, 2);
+    memcpy(data + 6, &rate_kbps, 4);
+    return CONTROL_REPORT_LEN;
+}
+
+inline bool control_report_parse(const char *data, size_t len, receiver_report &report)
+{
+    if (len < CONTROL_REPORT_LEN)
+        return false;
+    uint16_t loss_permille;
+    uint16_t jitter_ms;
+    uint32_t rate_kbps;
+    memcpy(&loss_permille, data + 2, 2);
+    memcpy(&jitter_ms, data + 4, 2);
+    memcpy(&rate_kbps, data + 6, 4);
+    report.loss_permille = ntohs(loss_permille);
+    report.jitter_ms = ntohs(jitter_ms);
+    report.rate_kbps = ntohl(rate_kbps);
+    return true;
+}
+
+/**
+ * Negative acknowledgement, sent by clients for a lost composite RTP packet, which the server then retransmits if still cached.
+ * Layout: magic, type, SSRC and sequence number in network byte order.
+ */
+const size_t CONTROL_NACK_LEN = CONTROL_HEADER_LEN + 6;
+
+inline size_t control_nack_make(char *data, uint32_t ssrc, uint16_t seq)
+{
+    data[0] = CONTROL_MAGIC;
+    data[1] = CONTROL_NACK;
+    ssrc = htonl(ssrc);
+    seq = htons(seq);
+    memcpy(data + 2, &ssrc, 4);
+    memcpy(data + 6, &seq, 2);
+    return CONTROL_NACK_LEN;
+}
+
+inline bool control_nack_parse(const char *data, size_t len, uint32_t &ssrc, uint16_t &seq)
+{
+    if (len < CONTROL_NACK_LEN)
+        return false;
+    memcpy(&ssrc, data + 2, 4);
+    memcpy(&seq, data + 6, 2);
+    ssrc = ntohl(ssrc);
+    seq = ntohs(seq);
+    return true;
+}
+
+// Server modes: composite, where clients receive one composite stream, and SFU (selective forwarding), where clients receive the streams of all sources and composite them locally
+const uint8_t SERVER_MODE_COMPOSITE = 0;
+const uint8_t SERVER_MODE_SFU = 1;
+
+/**
+ * Server configuration, sent by the server in reply to join messages, so that clients set up their capture and playback to match.
+ */
+struct server_config
+{
+    uint8_t mode;
+    // Size of the video of each source, which source clients capture and the composite layout is made of
+    uint16_t cell_width = 320;
+    uint16_t cell_height = 240;
+    // Maximum composite size, whose aspect ratio the composite layout targets
+    uint16_t output_width = 1280;
+    uint16_t output_height = 720;
+    // Frame rate of the captured and composite video, in frames per second
+    uint8_t framerate = 30;
+};
+
+// Config message length: magic, type, mode, then the sizes in network byte order and the frame rate
+const size_t CONTROL_CONFIG_LEN = CONTROL_HEADER_LEN + 10;
+
+// Config message length of servers that only sent their mode, whose clients use the default sizes and frame rate
+const size_t CONTROL_CONFIG_MODE_LEN = CONTROL_HEADER_LEN + 1;
+
+inline size_t control_config_make(char *data, const server_config &config)
+{
+    data[0] = CONTROL_MAGIC;
+    data[1] = CONTROL_CONFIG;
+    data[2] = config.mode;
+    uint16_t sizes[] = {htons(config.cell_width), htons(config.cell_height), htons(config.output_width), htons(config.output_height)};
+    memcpy(data + 3, sizes, sizeof(sizes));
+    data[11] = config.framerate;
+    return CONTROL_CONFIG_LEN;
+}
+
+inline bool control_config_parse(const char *data, size_t len, server_config &config)
+{
+    if (len < CONTROL_CONFIG_MODE_LEN)
+        return false;
+    config = server_config{(uint8_t)data[2]};
+    if (len < CONTROL_CONFIG_LEN)
+        return true;
+    uint16_t sizes[4];
+    memcpy(sizes, data + 3, sizeof(sizes));
+    // Sizes are kept even, as required by x264enc, and the frame rate positive
+    config.cell_width = std::max(2, ntohs(sizes[0]) & ~1);
+    config.cell_height = std::max(2, ntohs(sizes[1]) & ~1);
+    config.output_width = std::max(2, ntohs(sizes[2]) & ~1);
+    config.output_height = std::max(2, ntohs(sizes[3]) & ~1);
+    config.framerate = std::max(1, (int)(uint8_t)data[11]);
+    return true;
+}
+
+// Cell message length: magic, type, then the cell width and height in network byte order
+const size_t CONTROL_CELL_LEN = CONTROL_HEADER_LEN + 4;
+
+/**
+ * Cell message, sent by the server to a source client in composite mode, in reply to its join messages and whenever the layout changes, with the size at which the composite shows the video of the source, so that the client encodes at that size rather than at a larger one the server would scale down.
+ */
+inline size_t control_cell_make(char *data, uint16_t width, uint16_t height)
+{
+    data[0] = CONTROL_MAGIC;
+    data[1] = CONTROL_CELL;
+    uint16_t sizes[] = {htons(width), htons(height)};
+    memcpy(data + CONTROL_HEADER_LEN, sizes, sizeof(sizes));
+    return CONTROL_CELL_LEN;
+}
+
+inline bool control_cell_parse(const char *data, size_t len, uint16_t &width, uint16_t &height)
+{
+    if (len < CONTROL_CELL_LEN)
+        return false;
+    uint16_t sizes[2];
+    memcpy(sizes, data + CONTROL_HEADER_LEN, sizeof(sizes));
+    // Sizes are kept even, as required by x264enc
+    width = std::max(2, ntohs(sizes[0]) & ~1);
+    height = std::max(2, ntohs(sizes[1]) & ~1);
+    return true;
+}
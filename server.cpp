@@ -4,673 +4,3886 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 #include <arpa/inet.h>
+#include <linux/net_tstamp.h>
+#include <netinet/udp.h>
 #include <gio/gio.h>
 #include <gst/gst.h>
 #include <poll.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <tuple>
 #include <vector>
+#include "jitterbuffer.h"
+#include "latency.h"
+#include "metrics.h"
+#include "protocol.h"
 
-// TODO Check whether this should be higher
+// Largest datagram relayed. Client and composite packets stay within RTP_PAYLOADER_MTU plus the header extensions of latency.h, and control messages are smaller. Receive batches, io_uring buffers and the retransmission ring slots of each rendition are all of this size, so it is not raised to the UDP maximum.
 const int BUFFER_SIZE = 4096;
-const int MAX_CLIENTS = 9;
-
-struct sockaddr_in_cmp
+static_assert(BUFFER_SIZE >= RTP_PAYLOADER_MTU + SOURCE_CAPTURE_TIMES_EXTENSION_MAX_LEN, "Composite packets must fit in a buffer");
+// Maximum number of datagrams handled per recvmmsg call in batched relay mode
+const int BATCH_SIZE = 32;
+// Number of recent composite packets cached per rendition for retransmission, a power of two
+const size_t RETRANSMISSION_RING_SIZE = 1024;
+
+// Relay syscall counters, for confirming the effectiveness of batching
+struct relay_stats
 {
-    bool operator()(const sockaddr_in &lhs, const sockaddr_in &rhs) const
-    {
-        if (lhs.sin_addr.s_addr != rhs.sin_addr.s_addr)
-            return lhs.sin_addr.s_addr < rhs.sin_addr.s_addr;
-        return lhs.sin_port < rhs.sin_port;
-    }
+    uint64_t recv_calls = 0;
+    uint64_t recv_packets = 0;
+    uint64_t send_calls = 0;
+    uint64_t send_packets = 0;
 };
 
-// Active clients
-std::set<sockaddr_in, sockaddr_in_cmp> client_sockaddrs;
-
-// Active source clients (each client is a video source)
-std::set<sockaddr_in, sockaddr_in_cmp> source_client_sockaddrs;
-// Active sink clients (each client is a video sink)
-std::set<sockaddr_in, sockaddr_in_cmp> sink_client_sockaddrs;
+// Each relay thread (router or worker) counts its own syscalls
+thread_local relay_stats stats;
 
-// Maps client address to GStreamer pipeline udpsrc address
-std::map<sockaddr_in, sockaddr_in, sockaddr_in_cmp> client_routes;
+// Serializes multi-line output from different threads
+std::mutex output_mutex;
 
-// Maps client address to last activity time
-std::map<sockaddr_in, gint64, sockaddr_in_cmp> client_activity;
-
-// GStreamer pipeline unused udpsrc socket addresses
-// Use as a stack? Initialize in reverse?
-// TODO Initialize with specific size for efficiency, with reserve?
-std::vector<sockaddr_in> udpsrc_sockaddrs_available;
-
-std::vector<int> udpsrc_socks;
+/**
+ * Relay thread metrics, exposed by the metrics endpoint. Each relay thread (router or worker) updates its own, so that counting costs no contention.
+ */
+struct thread_metrics
+{
+    std::string thread_name;
+    // Client packets received by the router
+    std::atomic<uint64_t> ingress_packets{0};
+    std::atomic<uint64_t> ingress_bytes{0};
+    // Source client packets routed by the worker to the composite pipeline
+    std::atomic<uint64_t> route_packets{0};
+    // Packets sent by the worker to sink clients
+    std::atomic<uint64_t> egress_packets{0};
+    std::atomic<uint64_t> egress_bytes{0};
+    // Durations of routing a receive batch (router), of relaying composite packets to the sink clients (worker), of the client inactivity sweeps and of the relay loop iterations
+    histogram route_duration;
+    histogram fanout_duration;
+    histogram sweep_duration;
+    histogram loop_duration;
+};
 
-std::vector<GSocket *> udpsrc_gsocks;
+// Metrics of all relay threads, registered as the threads start
+std::vector<std::unique_ptr<thread_metrics>> thread_metrics_list;
+std::mutex thread_metrics_mutex;
 
-// Maps udpsrc address to udpsrc index in pipeline
-std::map<sockaddr_in, size_t, sockaddr_in_cmp> udpsrc_ixs;
+// Metrics of the current relay thread, nullptr unless the metrics endpoint is enabled
+thread_local thread_metrics *metrics = nullptr;
 
-// GStreamer pipeline compositor sink pads in order of creation
-std::vector<GstPad *> compositor_pads;
+// Metrics endpoint TCP port, 0 for none
+int metrics_port = 0;
 
-void init_compositor_pads(GstElement *compositor)
+void thread_metrics_register(const std::string &thread_name)
 {
-    GstPad *sink;
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-        std::string sink_name = std::string("sink_") + std::to_string(i);
-        sink = gst_element_get_static_pad(compositor, sink_name.c_str());
-        compositor_pads.push_back(sink);
-    }
+    if (metrics_port == 0)
+        return;
+    std::lock_guard<std::mutex> lock(thread_metrics_mutex);
+    thread_metrics_list.push_back(std::make_unique<thread_metrics>());
+    metrics = thread_metrics_list.back().get();
+    metrics->thread_name = thread_name;
 }
 
-// Sequence of {i, j} compositor cell row index and column index pair, in order of usage
-std::vector<std::pair<uint8_t, uint8_t>> position_cells;
-
-void init_position_cells(uint16_t cell_width, uint16_t cell_height, float target_aspect_ratio)
+void print_relay_stats(const std::string &thread_name)
 {
-    uint8_t rows = 1;
-    uint8_t cols = 1;
-    position_cells.push_back({0, 0});
-    while (true)
+    if (stats.recv_calls > 0 || stats.send_calls > 0)
     {
-        if (rows * cols >= MAX_CLIENTS)
-            break;
-        // Calculation of deviation from target aspect ratio when adding a column and when adding a row, respectively
-        float horizontal_expansion_dev = std::abs((float)(cell_width * (cols + 1)) / (float)(cell_height * rows) - target_aspect_ratio);
-        float vertical_expansion_dev = std::abs((float)(cell_width * cols) / (float)(cell_height * (rows + 1)) - target_aspect_ratio);
-        // Adding a column yields a better aspect ratio
-        if (horizontal_expansion_dev < vertical_expansion_dev)
-        {
-            cols++;
-            const uint8_t j = cols - 1;
-            for (uint8_t i = 0; i < rows; i++)
-            {
-                position_cells.push_back({i, j});
-            }
-        }
-        // Adding a row yields a better aspect ratio
-        else
-        {
-            rows++;
-            const uint8_t i = rows - 1;
-            for (uint8_t j = 0; j < cols; j++)
-            {
-                position_cells.push_back({i, j});
-            }
-        }
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "Relay (" << thread_name << "): ";
+        std::cout << (stats.recv_calls > 0 ? (double)stats.recv_packets / stats.recv_calls : 0.0) << " packets per receive syscall, ";
+        std::cout << (stats.send_calls > 0 ? (double)stats.send_packets / stats.send_calls : 0.0) << " packets per send syscall" << std::endl;
     }
+    stats = relay_stats{};
 }
 
-// Sequence of {x, y} compositor cell top-left point x coordinate and y coordinate pair, in order of usage
-std::vector<std::pair<uint16_t, uint16_t>> position_points;
+// Client roles, combined as bit flags
+const uint8_t CLIENT_ROLE_SOURCE = 1;
+const uint8_t CLIENT_ROLE_SINK = 2;
+// Source client beyond the maximum number of sources, whose video data is dropped before decoding until a source element becomes available
+const uint8_t CLIENT_ROLE_HIDDEN_SOURCE = 4;
+
+/**
+ * Active client state, kept in one place so that handling a client packet costs a single lookup.
+ */
+struct client_entry
+{
+    sockaddr_in sockaddr;
+    // Last activity time
+    gint64 activity;
+    // Bitwise OR of client roles
+    uint8_t roles;
+    // GStreamer pipeline source element (udpsrc or appsrc) index the client is routed to (source clients only)
+    size_t src_ix;
+    // Whether video data is dropped until the next keyframe, so that a new sub-pipeline starts decoding cleanly (source clients only)
+    bool is_keyframe_awaited;
+    // Composite rendition index (sink clients only)
+    uint8_t rendition;
+    // Highest quality rendition index requested by the client, a bound for adaptation
+    uint8_t rendition_min;
+    // Latest receiver report and its arrival time, 0 if none has arrived
+    receiver_report report;
+    gint64 report_time;
+    // Consecutive adaptation checks without congestion
+    uint8_t uncongested_check_count;
+    // Packets and bytes received from and sent to the client
+    uint64_t recv_packets = 0;
+    uint64_t recv_bytes = 0;
+    uint64_t send_packets = 0;
+    uint64_t send_bytes = 0;
+    // Departure time of the next packet to the client, i.e. the virtual time of its pacing token bucket (sink clients only)
+    gint64 pacing_time = 0;
+};
 
-void init_position_points()
+/**
+ * Open-addressed hash table keyed by address and port, for entries with a sockaddr member.
+ * Entries are stored in a dense array, which is what iteration (e.g. fan-out) walks, and slots hold entry indices, probed linearly.
+ * Entry pointers and indices are invalidated by insert and erase.
+ */
+template <typename Entry>
+struct sockaddr_table
 {
-    for (const auto &position_cell : position_cells)
+    std::vector<Entry> entries;
+    // Entry index per slot, -1 for empty slots; the slot count is a power of two
+    std::vector<int32_t> slots = std::vector<int32_t>(16, -1);
+
+    size_t slot_home(const sockaddr_in &sockaddr) const
     {
-        position_points.push_back({320 * position_cell.second, 240 * position_cell.first});
+        uint64_t key = ((uint64_t)sockaddr.sin_addr.s_addr << 16) | sockaddr.sin_port;
+        // Fibonacci hashing, high bits are the best mixed
+        return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (slots.size() - 1);
     }
-}
 
-// Available positions for placing clients, as a stack. The next available position to use is taken from the back.
-std::vector<size_t> positions_available;
-
-void init_positions_available()
-{
-    for (int i = MAX_CLIENTS - 1; i >= 0; i--)
+    // Returns the slot holding the entry or, if absent, the empty slot where it would be inserted
+    size_t slot_find(const sockaddr_in &sockaddr) const
     {
-        positions_available.push_back(i);
+        size_t mask = slots.size() - 1;
+        for (size_t i = slot_home(sockaddr);; i = (i + 1) & mask)
+        {
+            if (slots[i] == -1)
+                return i;
+            const auto &entry_sockaddr = entries[slots[i]].sockaddr;
+            if (entry_sockaddr.sin_addr.s_addr == sockaddr.sin_addr.s_addr && entry_sockaddr.sin_port == sockaddr.sin_port)
+                return i;
+        }
     }
-}
-
-// Maps udpsrc address to position
-std::map<sockaddr_in, size_t, sockaddr_in_cmp> udpsrc_positions;
 
-uint8_t rows = 0;
-uint8_t cols = 0;
-
-void update_grid_size()
-{
-    uint8_t max_i = 0;
-    uint8_t max_j = 0;
-    for (const auto &client_sockaddr : source_client_sockaddrs)
+    Entry *find(const sockaddr_in &sockaddr)
     {
-        auto udpsrc_sockaddr = client_routes[client_sockaddr];
-        auto udpsrc_position = udpsrc_positions[udpsrc_sockaddr];
-        auto position_cell = position_cells[udpsrc_position];
-        max_i = std::max(max_i, position_cell.first);
-        max_j = std::max(max_j, position_cell.second);
+        auto ix = slots[slot_find(sockaddr)];
+        return ix == -1 ? nullptr : &entries[ix];
     }
-    rows = max_i + 1;
-    cols = max_j + 1;
-}
 
-void compact_positions()
-{
-    // Ensure that at least one position is available
-    if (positions_available.size())
+    // The entry must not be present
+    Entry &insert(const sockaddr_in &sockaddr)
     {
-        // Sort available positions in descending order
-        sort(positions_available.begin(), positions_available.end(), std::greater<size_t>());
-
-        auto lowest_position_available = positions_available.back();
-        // If the lowest available position is less than the client count, then there is at least one client with a higher position
-        if (lowest_position_available < source_client_sockaddrs.size())
+        // Keep the load factor at most 1/2, so that probe sequences stay short
+        if ((entries.size() + 1) * 2 > slots.size())
         {
-            for (const auto &client_sockaddr : source_client_sockaddrs)
+            slots.assign(slots.size() * 2, -1);
+            for (size_t ix = 0; ix < entries.size(); ix++)
             {
-                auto udpsrc_sockaddr = client_routes[client_sockaddr];
-                auto udpsrc_position = udpsrc_positions[udpsrc_sockaddr];
-
-                // If the current client position is greater than the lowest available position, then the latter should be used for the client and the former should become available for later use
-                if (udpsrc_position > lowest_position_available)
-                {
-                    auto udpsrc_ix = udpsrc_ixs[udpsrc_sockaddr];
-                    auto pad = compositor_pads[udpsrc_ix];
-
-                    udpsrc_positions[udpsrc_sockaddr] = lowest_position_available;
-                    auto position_point = position_points[lowest_position_available];
-                    g_object_set(pad, "xpos", position_point.first, "ypos", position_point.second, nullptr);
-
-                    positions_available.pop_back();
-                    positions_available.push_back(udpsrc_position);
-
-                    sort(positions_available.begin(), positions_available.end(), std::greater<size_t>());
-                    lowest_position_available = positions_available.back();
-                }
+                slots[slot_find(entries[ix].sockaddr)] = ix;
             }
         }
+        slots[slot_find(sockaddr)] = entries.size();
+        entries.push_back(Entry{});
+        entries.back().sockaddr = sockaddr;
+        return entries.back();
     }
-}
-
-void crop_videobox(uint8_t rows, uint8_t cols, GstElement *capsfilter)
-{
-    uint16_t width = 320 * cols;
-    uint16_t height = 240 * rows;
-    GstCaps *caps = gst_caps_new_simple("video/x-raw",
-                                        "width", G_TYPE_INT, width,
-                                        "height", G_TYPE_INT, height,
-                                        nullptr);
-    g_object_set(capsfilter, "caps", caps, nullptr);
-}
 
-/**
- * Initializes udpsrc elements.
- */
-void init_udpsrcs(GstElement *pipeline, std::string client_name_prefix)
-{
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    void erase(const sockaddr_in &sockaddr)
     {
-        int udpsrc_sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (udpsrc_sock == -1)
-        {
-            std::cerr << "Failed to create udpsrc_sock." << std::endl;
+        size_t i = slot_find(sockaddr);
+        auto ix = slots[i];
+        if (ix == -1)
             return;
-        }
-
-        sockaddr_in udpsrc_sockaddr{};
-        udpsrc_sockaddr.sin_family = AF_INET;
-        inet_pton(AF_INET, "127.0.0.1", &(udpsrc_sockaddr.sin_addr));
-        udpsrc_sockaddr.sin_port = htons(0); // Assign any port
 
-        if (bind(udpsrc_sock, (struct sockaddr *)&udpsrc_sockaddr, sizeof(udpsrc_sockaddr)) == -1)
+        // Move the last entry into the erased one, keeping entries dense
+        size_t last_ix = entries.size() - 1;
+        if ((size_t)ix != last_ix)
         {
-            std::cerr << "Failed to bind udpsrc_sock." << std::endl;
-            return;
+            size_t last_slot = slot_find(entries[last_ix].sockaddr);
+            entries[ix] = std::move(entries[last_ix]);
+            slots[last_slot] = ix;
         }
+        entries.pop_back();
 
-        socklen_t udpsrc_sockaddr_len = sizeof(udpsrc_sockaddr);
-        if (getsockname(udpsrc_sock, (struct sockaddr *)&udpsrc_sockaddr, &udpsrc_sockaddr_len) == -1)
+        // Backward shift deletion: move later slots of the probe sequence into the hole, unless their home lies cyclically in (i, j]
+        size_t mask = slots.size() - 1;
+        for (size_t j = (i + 1) & mask; slots[j] != -1; j = (j + 1) & mask)
         {
-            std::cerr << "Failed to get udpsrc_sock name." << std::endl;
-            return;
+            size_t k = slot_home(entries[slots[j]].sockaddr);
+            bool is_home_between = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+            if (!is_home_between)
+            {
+                slots[i] = slots[j];
+                i = j;
+            }
         }
+        slots[i] = -1;
+    }
+};
 
-        GSocket *udpsrc_gsock = g_socket_new_from_fd(udpsrc_sock, nullptr);
+using client_table = sockaddr_table<client_entry>;
 
-        if (udpsrc_gsock == nullptr)
-        {
-            std::cerr << "Failed to create udpsrc_gsock." << std::endl;
-            return;
-        }
+// Maximum number of source clients per room, each one of which gets a composite pipeline client sub-pipeline
+size_t max_sources = 9;
 
-        std::string udpsrc_name = client_name_prefix + std::to_string(i) + "_udpsrc";
-        GstElement *udpsrc = gst_bin_get_by_name(GST_BIN(pipeline), udpsrc_name.c_str());
-        g_object_set(udpsrc, "socket", udpsrc_gsock, nullptr);
+// Whether the composite keeps the maximum composite size, with the grid of cells letterboxed in it, instead of following the grid size
+bool is_fixed_output = false;
 
-        udpsrc_ixs[udpsrc_sockaddr] = i;
-        udpsrc_socks.push_back(udpsrc_sock);
-        udpsrc_sockaddrs_available.push_back(udpsrc_sockaddr);
-        udpsrc_gsocks.push_back(udpsrc_gsock);
-    }
-}
+// Time a larger grid is kept after sources leave, before the composite shrinks to the grid of the remaining ones, so that sources leaving and joining again meanwhile do not resize it, in microseconds
+const gint64 GRID_SHRINK_DELAY = 10000000;
+
+// Thread budget of the composite pipeline of each room, split between the compositor and the encoders of the renditions, 0 for the GStreamer defaults
+int composite_threads = 0;
+
+// Cell size, maximum composite size and frame rate, which drive the composite layout and are sent to clients in config messages, along with the server mode
+server_config video_config{SERVER_MODE_COMPOSITE};
 
 /**
- * Composite pipeline client sub-pipeline description: udpsrc name={client_name}_udpsrc caps="application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264, payload=(int)96" ! rtph264depay ! avdec_h264 ! videoscale ! videoconvert ! video/x-raw, framerate=30/1, width=320, height=240 ! compositor.
+ * Composite output rendition: an encoding of the composite at its own bitrate and scale.
  */
-void composite_pipeline_client_add(GstElement *pipeline, std::string client_name)
+struct rendition_spec
 {
-    // FIXME Do not rely on the name, rather provide the compositor element as an argument
-    GstElement *compositor = gst_bin_get_by_name(GST_BIN(pipeline), "compositor");
-
-    GstElement *udpsrc = gst_element_factory_make("udpsrc", (client_name + "_udpsrc").c_str());
-    GstElement *rtph264depay = gst_element_factory_make("rtph264depay", (client_name + "_rtph264depay").c_str());
-    GstElement *avdec_h264 = gst_element_factory_make("avdec_h264", (client_name + "_avdec_h264").c_str());
-    GstElement *videoscale = gst_element_factory_make("videoscale", (client_name + "_videoscale").c_str());
-    GstElement *videoconvert = gst_element_factory_make("videoconvert", (client_name + "_videoconvert").c_str());
-    GstElement *capsfilter = gst_element_factory_make("capsfilter", (client_name + "_capsfilter").c_str());
+    // x264enc bitrate, in kbit/s
+    int bitrate;
+    // Scale relative to the composite size
+    float scale;
+};
 
-    GstCaps *caps = gst_caps_new_simple("application/x-rtp",
-                                        "media", G_TYPE_STRING, "video",
-                                        "clock-rate", G_TYPE_INT, 90000,
-                                        "encoding-name", G_TYPE_STRING, "H264",
-                                        "payload", G_TYPE_INT, 96,
-                                        nullptr);
-    g_object_set(udpsrc, "caps", caps, nullptr);
-    gst_caps_unref(caps);
+// Composite output renditions, from highest to lowest quality. Each sink client receives exactly one of them.
+std::vector<rendition_spec> rendition_specs = {{500, 1.0}};
 
-    caps = gst_caps_new_simple("video/x-raw",
-                               "framerate", GST_TYPE_FRACTION, 30, 1,
-                               "width", G_TYPE_INT, 320,
-                               "height", G_TYPE_INT, 240,
-                               nullptr);
-    g_object_set(capsfilter, "caps", caps, nullptr);
-    gst_caps_unref(caps);
+// Whether source client packets are forwarded to the sink clients of the room as they are, instead of being composited (SFU mode)
+bool is_sfu = false;
 
-    gst_bin_add_many(GST_BIN(pipeline), udpsrc, rtph264depay, avdec_h264, videoscale, videoconvert, capsfilter, nullptr);
+// Playout delay mode of the source client sub-pipelines
+jitterbuffer_mode source_jitterbuffer_mode = jitterbuffer_mode::minimal;
 
-    gst_element_link_many(udpsrc, rtph264depay, avdec_h264, videoscale, videoconvert, capsfilter, nullptr);
+// ULPFEC overhead of the composite renditions, in percent of the media packets, 0 for none
+int fec_percentage = 0;
 
-    GstPad *capsfilter_src_pad = gst_element_get_static_pad(capsfilter, "src");
-    if (!capsfilter_src_pad)
-    {
-        g_printerr("Failed to get capsfilter src pad.\n");
-        gst_object_unref(pipeline);
-        return;
-    }
+// Whether rendition bitrates and sink client renditions adapt to receiver reports
+bool is_adaptive = false;
 
-    GstPad *compositor_sink_pad = gst_element_request_pad_simple(compositor, "sink_%u");
-    if (!compositor_sink_pad)
-    {
-        g_printerr("Failed to get compositor request sink pad.\n");
-        gst_object_unref(capsfilter_src_pad);
-        gst_object_unref(pipeline);
-        return;
-    }
+// Receiver report thresholds above which a sink client is considered congested
+const uint16_t CONGESTION_LOSS_PERMILLE = 50;
+const uint16_t CONGESTION_JITTER_MS = 30;
 
-    if (gst_pad_link(capsfilter_src_pad, compositor_sink_pad) != GST_PAD_LINK_OK)
-    {
-        g_printerr("Failed to link capsfilter and compositor pads.\n");
-        gst_object_unref(capsfilter_src_pad);
-        gst_object_unref(compositor_sink_pad);
-        gst_object_unref(pipeline);
-        return;
-    }
+// Whether client packets are pushed into appsrc elements and composite packets are pulled from an appsink, instead of going through loopback UDP
+bool is_in_process = false;
 
-    gst_object_unref(capsfilter_src_pad);
-    gst_object_unref(compositor_sink_pad);
-}
+// Whether datagrams are received with recvmmsg and sent with sendmmsg, in batches
+bool is_batched = false;
 
-/**
- * Composite pipeline description: compositor name=compositor background=black zero-size-is-unscaled=false ! videobox autocrop=true ! capsfilter name=capsfilter caps="video/x-raw, width=320, height=240" ! x264enc tune=zerolatency bitrate=500 speed-preset=superfast ! rtph264pay ! udpsink name=udpsink host=127.0.0.1
- */
-GstElement *composite_pipeline_make(int udpsink_port)
-{
-    GstElement *pipeline = gst_pipeline_new("composite-pipeline");
+// Whether datagrams are received with io_uring multishot receives into kernel-picked buffers and sent with batched io_uring submissions, instead of with poll and receive and send syscalls
+bool is_uring = false;
 
-    GstElement *compositor = gst_element_factory_make("compositor", "compositor");
-    GstElement *videobox = gst_element_factory_make("videobox", "videobox");
-    GstElement *capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
-    GstElement *x264enc = gst_element_factory_make("x264enc", "x264enc");
-    GstElement *rtph264pay = gst_element_factory_make("rtph264pay", "rtph264pay");
-    GstElement *udpsink = gst_element_factory_make("udpsink", "udpsink");
+// Whether composite packets are queued per frame and sent to each sink client in runs of equal size packets, which the kernel segments (UDP generic segmentation offload)
+bool is_gso = false;
 
-    if (!pipeline || !compositor || !videobox || !capsfilter || !x264enc || !rtph264pay || !udpsink)
-    {
-        g_printerr("Failed to create composite pipeline elements.\n");
-        return nullptr;
-    }
+// UDP_SEGMENT limits: segments per send call and bytes per run
+const size_t GSO_MAX_SEGMENTS = 64;
+const size_t GSO_MAX_BYTES = 65000;
 
-    // background: black (1) – Black
-    g_object_set(compositor, "background", 1, "zero-size-is-unscaled", false, nullptr);
-    g_object_set(videobox, "autocrop", true, nullptr);
+// Egress queue bounds of a rendition, past which a frame is sent without waiting for its last packet (GSO mode)
+const size_t EGRESS_QUEUE_MAX_PACKETS = 256;
+const size_t EGRESS_QUEUE_MAX_BYTES = 256 * 1024;
 
-    GstCaps *caps = gst_caps_new_simple("video/x-raw",
-                                        "width", G_TYPE_INT, 320,
-                                        "height", G_TYPE_INT, 240,
-                                        nullptr);
-    g_object_set(capsfilter, "caps", caps, nullptr);
-    gst_caps_unref(caps);
+// Pacing rate of the composite packets to each sink client, as a multiple of the bitrate of its rendition, 0 for no pacing
+double pacing_multiple = 0;
 
-    // tune: zerolatency (0x00000004) – Zero latency
-    // bitrate: 500
-    // speed-preset: ultrafast (1) – ultrafast / superfast (2) – superfast
-    g_object_set(x264enc, "tune", 4, "bitrate", 500, "speed-preset", 2, nullptr);
-    g_object_set(udpsink, "host", "127.0.0.1", "port", udpsink_port, nullptr);
+// Whether paced packets are handed to the kernel at once with their departure times (SO_TXTIME), for the fq qdisc to hold, instead of being held by the worker
+bool is_txtime = false;
 
-    gst_bin_add_many(GST_BIN(pipeline), compositor, videobox, capsfilter, x264enc, rtph264pay, udpsink, nullptr);
+// Whether the server latency is measured and the source capture times are sent with composite frames, which costs probes on the pipeline threads and a lock per relayed packet
+bool is_latency_measured = false;
 
-    if (!gst_element_link_many(compositor, videobox, capsfilter, x264enc, rtph264pay, udpsink, nullptr))
-    {
-        g_printerr("Failed to link composite pipeline elements.\n");
-        gst_object_unref(pipeline);
-        return nullptr;
-    }
+// Sending ahead of the pacing rate allowed to a sink client after a pause, so that small frames go out at once
+const gint64 PACING_BURST_DURATION = 20000;
 
-    return pipeline;
-}
+// Socket for client to server and server to client (two-way) communication, shared by the router and the workers
+int server_sock = -1;
 
-void print_usage(char *program_name)
+/**
+ * Composite pipeline client sub-pipeline, created when a source client joins and destroyed when it leaves.
+ */
+struct source_branch
 {
-    fprintf(stderr, "Usage: %s [-p port]\n", program_name);
-}
+    // Elements in link order, starting with the source element (udpsrc or appsrc)
+    std::vector<GstElement *> elements;
+    GstPad *compositor_pad;
+    // GStreamer pipeline udpsrc socket address (loopback mode only)
+    sockaddr_in udpsrc_sockaddr;
+    GstElement *rtpjitterbuffer;
+    // Last element, whose caps set the size the source is scaled to
+    GstElement *capsfilter;
+    // Compositor position
+    size_t position;
+    // Timing of the frames of the source client, and of its frame the compositor took last, which the compositor output frames are attributed
+    frame_timings timings;
+    frame_timing composited;
+};
 
-int main(int argc, char *argv[])
+/**
+ * Cached composite RTP packet, in the slot of its sequence number modulo RETRANSMISSION_RING_SIZE. Unused while len is 0. The buffer is allocated along with the ring, so that caching never allocates.
+ */
+struct retransmission_slot
 {
-    int server_port = 27884;
-
-    int opt;
+    uint16_t seq;
+    size_t len = 0;
+    char data[BUFFER_SIZE];
+};
 
-    while ((opt = getopt(argc, argv, "p:h")) != -1)
-    {
-        switch (opt)
-        {
-        case 'p':
-            server_port = atoi(optarg);
-            break;
-        case 'h':
-            print_usage(argv[0]);
-            exit(EXIT_SUCCESS);
-        default:
-            print_usage(argv[0]);
-            exit(EXIT_FAILURE);
-        }
-    }
+struct room;
 
-    // Initialize GStreamer
-    gst_init(nullptr, nullptr);
+/**
+ * Composite pipeline rendition sub-pipeline and its egress path.
+ */
+struct rendition
+{
+    float scale;
+    GstElement *capsfilter = nullptr;
+    GstElement *x264enc = nullptr;
+
+    // Current x264enc bitrate and the configured one, which is its upper bound, in kbit/s
+    int bitrate;
+    int max_bitrate;
+
+    // Whether a sink client has started receiving the rendition since the last keyframe request
+    bool is_keyframe_needed = false;
+
+    // Recent composite RTP packets, for answering NACKs, and the SSRC of the rendition stream
+    std::vector<retransmission_slot> retransmission_ring = std::vector<retransmission_slot>(RETRANSMISSION_RING_SIZE);
+    uint32_t ssrc = 0;
+
+    // Socket for GStreamer pipeline udpsink to server (one-way) communication, unused in in-process mode
+    int udpsink_sock = -1;
+    int udpsink_port = 0;
+
+    // Composite packets pulled from the appsink by the streaming thread and not yet sent to clients by the worker
+    std::vector<GstBuffer *> appsink_buffers;
+    std::mutex appsink_buffers_mutex;
+
+    // Signaled when appsink_buffers becomes non-empty
+    int appsink_eventfd = -1;
+
+    // Timing of the composite frames, kept by the room, and arrival times of the newest source frames of the rendition frames, by RTP timestamp
+    frame_timings *composite_timings = nullptr;
+    frame_timings timings;
+
+    // Server latency from arrival of the newest source frame to sending of the rendition frame, since the last latency report (worker only)
+    gint64 latency_sum = 0;
+    gint64 latency_max = 0;
+    uint32_t latency_count = 0;
+
+    // The room of the rendition, nullptr once the room is closed, and the index of the rendition in it, for relaying io_uring receive completions (worker only)
+    room *owner = nullptr;
+    size_t rendition_ix = 0;
+
+    // Whether a multishot receive on udpsink_sock is armed (io_uring backend only)
+    bool is_uring_armed = false;
+
+    // Egress queue of the composite packets received since the last complete frame, sent once no frame is partially received, and whether it is listed by the worker (GSO mode only)
+    std::vector<char> egress_data;
+    std::vector<size_t> egress_lens;
+    bool is_frame_open = false;
+    // RTP timestamp of the last queued video packet, that of the open frame (GSO mode only)
+    uint32_t frame_timestamp = 0;
+    bool is_egress_pending = false;
+};
 
-    // Socket for client to server and server to client (two-way) communication
-    int server_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server_sock < 0)
-    {
-        std::cerr << "Failed to create server_sock." << std::endl;
-        return 1;
-    }
+/**
+ * Client packet routed to a room, stored in the room inbox data.
+ */
+struct inbox_packet
+{
+    sockaddr_in sockaddr;
+    size_t offset;
+    size_t len;
+};
 
-    sockaddr_in server_sockaddr{};
-    server_sockaddr.sin_family = AF_INET;
-    inet_pton(AF_INET, "0.0.0.0", &(server_sockaddr.sin_addr));
-    server_sockaddr.sin_port = htons(server_port);
+/**
+ * A composite with its own clients and composite pipeline. Rooms are created by the router when a client joins them and are owned by one worker thread, which handles all of their clients.
+ */
+struct room
+{
+    std::string name;
 
-    if (bind(server_sock, (struct sockaddr *)&server_sockaddr, sizeof(server_sockaddr)) < 0)
-    {
-        std::cerr << "Failed to bind server_sock." << std::endl;
-        return 1;
-    }
+    // Active clients
+    client_table clients;
 
-    // Socket for GStreamer pipeline udpsink to server (one-way) communication
-    int udpsink_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpsink_sock < 0)
-    {
-        std::cerr << "Failed to create udpsink_sock." << std::endl;
-        return 1;
-    }
+    // Active source client count (each source client is a video source)
+    size_t source_client_count = 0;
 
-    sockaddr_in udpsink_sockaddr{};
-    udpsink_sockaddr.sin_family = AF_INET;
-    inet_pton(AF_INET, "127.0.0.1", &(udpsink_sockaddr.sin_addr));
-    udpsink_sockaddr.sin_port = htons(0); // Assign any available port
+    GstElement *pipeline = nullptr;
+    GstElement *capsfilter = nullptr;
 
-    if (bind(udpsink_sock, (struct sockaddr *)&udpsink_sockaddr, sizeof(udpsink_sockaddr)) < 0)
-    {
-        std::cerr << "Failed to bind udpsink_sock." << std::endl;
-        return 1;
-    }
+    // Composite pipeline client sub-pipelines by source element index, nullptr for unused indices
+    std::vector<source_branch *> source_branches;
 
-    socklen_t sockaddr_int_len = sizeof(udpsink_sockaddr);
-    if (getsockname(udpsink_sock, (struct sockaddr *)&udpsink_sockaddr, &sockaddr_int_len) == -1)
-    {
-        std::cerr << "Failed to get socket name for udpsink_sock." << std::endl;
-        return 1;
-    }
+    // Unused source element indices below source_branches.size(), as a stack
+    std::vector<size_t> src_ixs_available;
 
-    auto udpsink_port = ntohs(udpsink_sockaddr.sin_port);
+    // Guards source_branches changes against the compositor streaming thread, which reads the composited frame timing of each branch
+    std::mutex source_branches_mutex;
 
-    struct pollfd fds[2];
+    // Timing of the composite frames, by PTS
+    frame_timings composite_timings;
 
-    // TODO Check whether using the same buffer for both sockets is OK and whether it should be outside of the loop
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    // TODO Same check for these
-    sockaddr_in client_sockaddr{};
-    socklen_t client_sockaddr_len = sizeof(client_sockaddr);
+    // Sequence of {i, j} compositor cell row index and column index pair, in order of usage
+    std::vector<std::pair<uint8_t, uint8_t>> position_cells;
 
-    fds[0].fd = server_sock;
-    fds[0].events = POLLIN;
-    fds[1].fd = udpsink_sock;
-    fds[1].events = POLLIN;
+    // Grid size covered by position_cells
+    uint8_t position_rows = 0;
+    uint8_t position_cols = 0;
 
-    std::string client_name_prefix = "client";
+    // Sequence of {rows, cols} grid size covering the positions up to each one, so that the grid of the positions in use is known without scanning the sources
+    std::vector<std::pair<uint8_t, uint8_t>> position_grids;
 
-    GstElement *pipeline = composite_pipeline_make(udpsink_port);
+    // Source element index at each position in use. Positions in use are kept contiguous from 0: the source at the last position moves into a freed one.
+    std::vector<size_t> position_src_ixs;
 
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-        composite_pipeline_client_add(pipeline, client_name_prefix + std::to_string(i));
-    }
+    // Grid size of the composite, which lags behind the grid of the positions in use when it shrinks
+    uint8_t rows = 1;
+    uint8_t cols = 1;
 
-    init_udpsrcs(pipeline, client_name_prefix);
+    // Time from which the grid of the positions in use has been smaller than the composite grid, 0 while it is not
+    gint64 grid_shrink_time = 0;
 
-    GstElement *capsfilter = gst_bin_get_by_name(GST_BIN(pipeline), "capsfilter");
+    // Size at which sources are composited: the configured cell size, shrunk so that the grid fits the maximum composite size
+    uint16_t cell_width = video_config.cell_width;
+    uint16_t cell_height = video_config.cell_height;
 
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    // Hidden source clients, in order of arrival, the first of which takes the next available source element
+    std::vector<sockaddr_in> hidden_sources;
 
-    init_position_cells(320, 240, 16.0 / 9.0);
+    // Composite renditions, as in rendition_specs
+    std::vector<std::unique_ptr<rendition>> renditions;
 
-    init_position_points();
+    // Client packets routed to the room by the router and not yet handled by the worker
+    std::vector<inbox_packet> inbox_packets;
+    std::vector<char> inbox_data;
+    std::mutex inbox_mutex;
 
-    init_positions_available();
+    // Signaled when the inbox becomes non-empty
+    int inbox_eventfd = -1;
 
-    GstElement *compositor = gst_bin_get_by_name(GST_BIN(pipeline), "compositor");
+    gint64 client_activity_check = 0;
+    gint64 adaptation_check = 0;
+    gint64 jitterbuffer_check = 0;
+    gint64 keyframe_check = 0;
 
-    init_compositor_pads(compositor);
+    // Router thread state: the worker owning the room and the count of clients routed to the room
+    size_t worker_ix = 0;
+    size_t route_count = 0;
 
-    gint64 current_time = g_get_monotonic_time();
-    gint64 client_activity_check = current_time;
+    // The router may still write to the inbox after the worker has closed the room
+    ~room()
+    {
+        close(inbox_eventfd);
+    }
+};
 
-    std::vector<sockaddr_in> client_sockaddrs_inactive;
+// Changes to the clients of a room during one relay loop iteration
+struct room_changes
+{
+    bool has_addition_occurred = false;
+    bool has_source_addition_occurred = false;
+    bool has_removal_occurred = false;
+    bool has_source_removal_occurred = false;
+};
 
-    bool has_addition_occurred;
-    bool has_source_addition_occurred;
-    bool has_removal_occurred;
-    bool has_source_removal_occurred;
+// Reusable buffers for pushing client packets into appsrc elements, shared by all rooms
+GstBufferPool *appsrc_buffer_pool = nullptr;
 
-    while (true)
+/**
+ * Grows position_cells by a column or a row at a time, whichever yields an aspect ratio closer to the target one, until there are at least count positions, and position_grids along.
+ */
+void grow_position_cells(room &r, size_t count, uint16_t cell_width, uint16_t cell_height, float target_aspect_ratio)
+{
+    if (r.position_cells.empty())
     {
-        // Block until a socket event occurs
-        int poll_res = poll(fds, 2, -1);
-        if (poll_res == -1)
+        r.position_rows = 1;
+        r.position_cols = 1;
+        r.position_cells.push_back({0, 0});
+    }
+    while (r.position_cells.size() < count)
+    {
+        // Calculation of deviation from target aspect ratio when adding a column and when adding a row, respectively
+        float horizontal_expansion_dev = std::abs((float)(cell_width * (r.position_cols + 1)) / (float)(cell_height * r.position_rows) - target_aspect_ratio);
+        float vertical_expansion_dev = std::abs((float)(cell_width * r.position_cols) / (float)(cell_height * (r.position_rows + 1)) - target_aspect_ratio);
+        // Adding a column yields a better aspect ratio
+        if (horizontal_expansion_dev < vertical_expansion_dev)
         {
-            std::cerr << "Poll error." << std::endl;
-            return 1;
+            r.position_cols++;
+            const uint8_t j = r.position_cols - 1;
+            for (uint8_t i = 0; i < r.position_rows; i++)
+            {
+                r.position_cells.push_back({i, j});
+            }
         }
-
-        current_time = g_get_monotonic_time();
-
-        has_addition_occurred = false;
-        has_source_addition_occurred = false;
-        has_removal_occurred = false;
-        has_source_removal_occurred = false;
-
-        // Check whether server_sock has data
-        if (fds[0].revents & POLLIN)
+        // Adding a row yields a better aspect ratio
+        else
         {
-            // Receive from client
-            bytes_read = recvfrom(server_sock, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_sockaddr, &client_sockaddr_len);
-            if (bytes_read < 0)
+            r.position_rows++;
+            const uint8_t i = r.position_rows - 1;
+            for (uint8_t j = 0; j < r.position_cols; j++)
             {
-                std::cerr << "Failed to receive from client." << std::endl;
-                continue;
+                r.position_cells.push_back({i, j});
             }
+        }
+    }
+    for (size_t position = r.position_grids.size(); position < r.position_cells.size(); position++)
+    {
+        const auto &position_cell = r.position_cells[position];
+        auto grid = position > 0 ? r.position_grids[position - 1] : std::pair<uint8_t, uint8_t>{1, 1};
+        r.position_grids.push_back({std::max<uint8_t>(grid.first, position_cell.first + 1), std::max<uint8_t>(grid.second, position_cell.second + 1)});
+    }
+}
 
-            // Update client activity time
-            client_activity[client_sockaddr] = current_time;
+/**
+ * Places the compositor pad of a source at a position, at the cell size of the room.
+ */
+void source_pad_place(const room &r, GstPad *pad, size_t position)
+{
+    const auto &position_cell = r.position_cells[position];
+    g_object_set(pad, "xpos", r.cell_width * position_cell.second, "ypos", r.cell_height * position_cell.first, "width", r.cell_width, "height", r.cell_height, nullptr);
+}
 
-            // If client is not an active client yet
-            if (client_sockaddrs.count(client_sockaddr) == 0)
-            {
-                // Add client to active clients
-                client_sockaddrs.insert(client_sockaddr);
+/**
+ * Takes the position after the ones in use for a source element.
+ */
+size_t source_position_take(room &r, size_t src_ix)
+{
+    size_t position = r.position_src_ixs.size();
+    grow_position_cells(r, position + 1, video_config.cell_width, video_config.cell_height, (float)video_config.output_width / video_config.output_height);
+    r.position_src_ixs.push_back(src_ix);
+    r.source_branches[src_ix]->position = position;
+    return position;
+}
 
-                // Video data received and position available
-                // This is not entered when a keepalive message is received (from a receive-only client) or a position is unavailable
-                if ((bytes_read > 0) && (udpsrc_sockaddrs_available.size() > 0))
-                {
-                    source_client_sockaddrs.insert(client_sockaddr);
+/**
+ * Frees a position, moving the source at the last position in use into it, so that positions in use stay contiguous with a single move.
+ */
+void source_position_release(room &r, size_t position)
+{
+    size_t last_src_ix = r.position_src_ixs.back();
+    r.position_src_ixs.pop_back();
+    if (position == r.position_src_ixs.size())
+        return;
+    r.position_src_ixs[position] = last_src_ix;
+    auto branch = r.source_branches[last_src_ix];
+    branch->position = position;
+    source_pad_place(r, branch->compositor_pad, position);
+}
+
+/**
+ * Updates the composite grid to the grid of the positions in use: at once when it grows, so that all sources show, and only after GRID_SHRINK_DELAY when it shrinks. Returns whether the composite grid changed.
+ */
+bool room_grid_update(room &r, gint64 current_time)
+{
+    auto grid = r.position_src_ixs.empty() ? std::pair<uint8_t, uint8_t>{1, 1} : r.position_grids[r.position_src_ixs.size() - 1];
+    if (grid.first == r.rows && grid.second == r.cols)
+    {
+        r.grid_shrink_time = 0;
+        return false;
+    }
+    // Grids of positions in use only grow or shrink along the sequence of positions, so either grid contains the other
+    if (grid.first < r.rows || grid.second < r.cols)
+    {
+        if (r.grid_shrink_time == 0)
+        {
+            r.grid_shrink_time = current_time;
+        }
+        if (current_time - r.grid_shrink_time < GRID_SHRINK_DELAY)
+            return false;
+    }
+    r.rows = grid.first;
+    r.cols = grid.second;
+    r.grid_shrink_time = 0;
+    return true;
+}
+
+/**
+ * Returns the size of the composite: the grid of cells, or the maximum composite size, if fixed.
+ */
+std::pair<int, int> composite_size(const room &r)
+{
+    if (is_fixed_output)
+        return {video_config.output_width, video_config.output_height};
+    return {r.cell_width * r.cols, r.cell_height * r.rows};
+}
+
+/**
+ * Sets the size videobox crops the compositor output to, which spans the positions in use, or adds black borders to, when the composite is larger, centering the grid.
+ */
+void crop_videobox(const room &r)
+{
+    auto size = composite_size(r);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "width", G_TYPE_INT, size.first,
+                                        "height", G_TYPE_INT, size.second,
+                                        "framerate", GST_TYPE_FRACTION, video_config.framerate, 1,
+                                        nullptr);
+    g_object_set(r.capsfilter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+}
+
+/**
+ * Sets the size of a rendition to the composite size, which fits the maximum composite size, times its scale, rounded down to even dimensions as required by x264enc.
+ */
+void scale_rendition(const room &r, const rendition &rend)
+{
+    auto size = composite_size(r);
+    int width = std::max(2, (int)(size.first * rend.scale) & ~1);
+    int height = std::max(2, (int)(size.second * rend.scale) & ~1);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "width", G_TYPE_INT, width,
+                                        "height", G_TYPE_INT, height,
+                                        nullptr);
+    g_object_set(rend.capsfilter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+}
+
+/**
+ * Creates a UDP socket bound to an available loopback port, stored in sockaddr. Returns the socket, or -1 on error.
+ */
+int loopback_sock_make(sockaddr_in &sockaddr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1)
+    {
+        std::cerr << "Failed to create loopback socket." << std::endl;
+        return -1;
+    }
+
+    sockaddr = sockaddr_in{};
+    sockaddr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &(sockaddr.sin_addr));
+    sockaddr.sin_port = htons(0); // Assign any available port
+
+    if (bind(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+    {
+        std::cerr << "Failed to bind loopback socket." << std::endl;
+        close(sock);
+        return -1;
+    }
+
+    socklen_t sockaddr_len = sizeof(sockaddr);
+    if (getsockname(sock, (struct sockaddr *)&sockaddr, &sockaddr_len) == -1)
+    {
+        std::cerr << "Failed to get loopback socket name." << std::endl;
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Initializes a udpsrc element with a socket bound to an available loopback port.
+ */
+bool init_udpsrc(GstElement *udpsrc, sockaddr_in &udpsrc_sockaddr)
+{
+    int udpsrc_sock = loopback_sock_make(udpsrc_sockaddr);
+    if (udpsrc_sock == -1)
+    {
+        std::cerr << "Failed to create udpsrc_sock." << std::endl;
+        return false;
+    }
+
+    GSocket *udpsrc_gsock = g_socket_new_from_fd(udpsrc_sock, nullptr);
+
+    if (udpsrc_gsock == nullptr)
+    {
+        std::cerr << "Failed to create udpsrc_gsock." << std::endl;
+        close(udpsrc_sock);
+        return false;
+    }
+
+    // The udpsrc closes the socket when stopped (close-socket defaults to true) and holds the only reference
+    g_object_set(udpsrc, "socket", udpsrc_gsock, nullptr);
+    g_object_unref(udpsrc_gsock);
+
+    return true;
+}
+
+/**
+ * Initializes the buffer pool for pushing client packets into appsrc elements.
+ */
+void init_appsrc_buffer_pool()
+{
+    appsrc_buffer_pool = gst_buffer_pool_new();
+    GstStructure *config = gst_buffer_pool_get_config(appsrc_buffer_pool);
+    // Preallocate a few frames worth of packets, with no upper limit
+    gst_buffer_pool_config_set_params(config, nullptr, BUFFER_SIZE, 64, 0);
+    if (!gst_buffer_pool_set_config(appsrc_buffer_pool, config) || !gst_buffer_pool_set_active(appsrc_buffer_pool, true))
+    {
+        std::cerr << "Failed to configure appsrc_buffer_pool." << std::endl;
+    }
+}
+
+/**
+ * Pushes a client packet into an appsrc element, copying it into a pooled buffer. The buffer returns to the pool once GStreamer is done with it.
+ */
+void appsrc_push(GstElement *appsrc, const char *data, size_t len)
+{
+    // Keepalive messages carry no data
+    if (len == 0)
+        return;
+
+    GstBuffer *buffer;
+    if (gst_buffer_pool_acquire_buffer(appsrc_buffer_pool, &buffer, nullptr) != GST_FLOW_OK)
+    {
+        std::cerr << "Failed to acquire buffer for appsrc." << std::endl;
+        return;
+    }
+    gst_buffer_fill(buffer, 0, data, len);
+    gst_buffer_set_size(buffer, len);
+
+    // Takes ownership of the buffer
+    if (gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer) != GST_FLOW_OK)
+    {
+        std::cerr << "Failed to push to GStreamer." << std::endl;
+    }
+}
+
+/**
+ * Appends an item to a queue shared with another thread, signaling the eventfd if the queue was empty. The consumer takes all queued items when woken, so it is only woken for the first one.
+ */
+template <typename Push>
+void queue_push(std::mutex &mutex, int eventfd, Push push)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        was_empty = push();
+    }
+
+    if (was_empty)
+    {
+        uint64_t count = 1;
+        if (write(eventfd, &count, sizeof(count)) < 0)
+        {
+            std::cerr << "Failed to signal eventfd." << std::endl;
+        }
+    }
+}
+
+/**
+ * Hands a composite packet from the appsink streaming thread over to the worker of the room.
+ */
+GstFlowReturn appsink_new_sample(GstAppSink *appsink, gpointer user_data)
+{
+    auto r = (rendition *)user_data;
+
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (sample == nullptr)
+        return GST_FLOW_ERROR;
+    GstBuffer *buffer = gst_buffer_ref(gst_sample_get_buffer(sample));
+    gst_sample_unref(sample);
+
+    queue_push(r->appsink_buffers_mutex, r->appsink_eventfd, [&]()
+               {
+                   bool was_empty = r->appsink_buffers.empty();
+                   r->appsink_buffers.push_back(buffer);
+                   return was_empty; });
+    return GST_FLOW_OK;
+}
+
+/**
+ * Stops a composite pipeline client sub-pipeline and removes it from the pipeline, releasing its compositor pad.
+ */
+void composite_pipeline_client_remove(GstElement *pipeline, source_branch *branch)
+{
+    // Source element first, so that data flow stops before the compositor pad is released
+    for (auto element : branch->elements)
+    {
+        gst_element_set_state(element, GST_STATE_NULL);
+    }
+
+    if (branch->compositor_pad)
+    {
+        // FIXME Do not rely on the name, rather provide the compositor element as an argument
+        GstElement *compositor = gst_bin_get_by_name(GST_BIN(pipeline), "compositor");
+        GstPad *capsfilter_src_pad = gst_pad_get_peer(branch->compositor_pad);
+        if (capsfilter_src_pad)
+        {
+            gst_pad_unlink(capsfilter_src_pad, branch->compositor_pad);
+            gst_object_unref(capsfilter_src_pad);
+        }
+        gst_element_release_request_pad(compositor, branch->compositor_pad);
+        gst_object_unref(branch->compositor_pad);
+        gst_object_unref(compositor);
+    }
+
+    for (auto element : branch->elements)
+    {
+        gst_bin_remove(GST_BIN(pipeline), element);
+    }
+
+    delete branch;
+}
+
+/**
+ * Takes note of the timing of each source frame the compositor receives, which it composites until the next one.
+ */
+GstPadProbeReturn compositor_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto branch = (source_branch *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    std::lock_guard<std::mutex> lock(branch->timings.mutex);
+    frame_timings_find(branch->timings.frames, pts, branch->composited);
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Attributes each composite frame the source frames composited last, keeping its timing by PTS for the rendition payloaders.
+ */
+GstPadProbeReturn compositor_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto &r = *(room *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    frame_timing timing;
+    {
+        std::lock_guard<std::mutex> lock(r.source_branches_mutex);
+        for (auto branch : r.source_branches)
+        {
+            if (branch == nullptr)
+                continue;
+            std::lock_guard<std::mutex> branch_lock(branch->timings.mutex);
+            const auto &composited = branch->composited;
+            timing.capture_times.insert(timing.capture_times.end(), composited.capture_times.begin(), composited.capture_times.end());
+            timing.ingress_time = std::max(timing.ingress_time, composited.ingress_time);
+        }
+    }
+
+    if (!timing.capture_times.empty())
+    {
+        std::lock_guard<std::mutex> lock(r.composite_timings.mutex);
+        frame_timings_push(r.composite_timings.frames, pts, std::move(timing));
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Adds the source capture times to the first packet of each rendition frame, and keeps the arrival time of its newest source frame by RTP timestamp, for measuring the server latency when the frame is sent.
+ */
+void rendition_packet_timing_add(rendition &rend, GstBuffer *buffer)
+{
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+        return;
+
+    uint32_t timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+    bool is_frame_start;
+    {
+        std::lock_guard<std::mutex> lock(rend.timings.mutex);
+        is_frame_start = timestamp != rend.timings.last_timestamp;
+        rend.timings.last_timestamp = timestamp;
+    }
+
+    frame_timing timing;
+    bool has_timing = false;
+    if (is_frame_start)
+    {
+        std::lock_guard<std::mutex> lock(rend.composite_timings->mutex);
+        has_timing = frame_timings_find(rend.composite_timings->frames, GST_BUFFER_PTS(buffer), timing);
+    }
+    if (has_timing)
+    {
+        rtp_source_capture_times_add(&rtp, timing.capture_times);
+        std::lock_guard<std::mutex> lock(rend.timings.mutex);
+        frame_timings_push(rend.timings.ingress_times, timestamp, timing.ingress_time);
+    }
+
+    gst_rtp_buffer_unmap(&rtp);
+}
+
+GstPadProbeReturn rendition_rtph264pay_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    auto &rend = *(rendition *)user_data;
+    probe_buffers_modify(info, [&](GstBuffer *buffer) { rendition_packet_timing_add(rend, buffer); });
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * Composite pipeline client sub-pipeline description: udpsrc name={client_name}_udpsrc caps="application/x-rtp, media=(string)video, clock-rate=(int)90000, encoding-name=(string)H264, payload=(int)96" ! rtpstorage size-time=250000000 ! rtpjitterbuffer latency={mode latency} do-retransmission=false do-lost=true ! rtpulpfecdec pt=122 ! rtph264depay ! avdec_h264 ! videoconvertscale ! video/x-raw, width={room cell width}, height={room cell height} ! compositor.
+ * In-process client sub-pipeline description: appsrc name={client_name}_appsrc caps="application/x-rtp, ..." is-live=true do-timestamp=true format=time ! rtph264depay ! ...
+ * Without videoconvertscale (GStreamer 1.22 or later), which converts and scales in one pass, the sub-pipeline falls back to videoscale ! videoconvert. Either passes frames through untouched when the source sends them at the cell size, as it does after a cell message.
+ * The sub-pipeline is added to the playing pipeline, named after source element index src_ix, and its state is synced with the pipeline.
+ */
+source_branch *composite_pipeline_client_add(GstElement *pipeline, size_t src_ix, uint16_t cell_width, uint16_t cell_height)
+{
+    std::string client_name = std::string("client") + std::to_string(src_ix);
+
+    // FIXME Do not rely on the name, rather provide the compositor element as an argument
+    GstElement *compositor = gst_bin_get_by_name(GST_BIN(pipeline), "compositor");
+
+    GstElement *src;
+    if (is_in_process)
+    {
+        src = gst_element_factory_make("appsrc", (client_name + "_appsrc").c_str());
+    }
+    else
+    {
+        src = gst_element_factory_make("udpsrc", (client_name + "_udpsrc").c_str());
+    }
+    GstElement *rtpstorage = gst_element_factory_make("rtpstorage", (client_name + "_rtpstorage").c_str());
+    GstElement *rtpjitterbuffer = gst_element_factory_make("rtpjitterbuffer", (client_name + "_rtpjitterbuffer").c_str());
+    GstElement *rtpulpfecdec = gst_element_factory_make("rtpulpfecdec", (client_name + "_rtpulpfecdec").c_str());
+    GstElement *rtph264depay = gst_element_factory_make("rtph264depay", (client_name + "_rtph264depay").c_str());
+    GstElement *avdec_h264 = gst_element_factory_make("avdec_h264", (client_name + "_avdec_h264").c_str());
+    std::vector<GstElement *> converters = {gst_element_factory_make("videoconvertscale", (client_name + "_videoconvertscale").c_str())};
+    if (!converters[0])
+    {
+        converters = {gst_element_factory_make("videoscale", (client_name + "_videoscale").c_str()),
+                      gst_element_factory_make("videoconvert", (client_name + "_videoconvert").c_str())};
+    }
+    GstElement *capsfilter = gst_element_factory_make("capsfilter", (client_name + "_capsfilter").c_str());
+
+    if (!src || !rtpstorage || !rtpjitterbuffer || !rtpulpfecdec || !rtph264depay || !avdec_h264 || std::find(converters.begin(), converters.end(), nullptr) != converters.end() || !capsfilter)
+    {
+        g_printerr("Failed to create composite pipeline client elements.\n");
+        gst_object_unref(compositor);
+        // Elements not added to a bin are still floating, which gst_object_unref() handles
+        std::vector<GstElement *> elements = {src, rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264, capsfilter};
+        elements.insert(elements.end(), converters.begin(), converters.end());
+        for (auto element : elements)
+        {
+            if (element)
+            {
+                gst_object_unref(element);
+            }
+        }
+        return nullptr;
+    }
+
+    GstCaps *caps = gst_caps_new_simple("application/x-rtp",
+                                        "media", G_TYPE_STRING, "video",
+                                        "clock-rate", G_TYPE_INT, 90000,
+                                        "encoding-name", G_TYPE_STRING, "H264",
+                                        "payload", G_TYPE_INT, 96,
+                                        nullptr);
+    g_object_set(src, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    // Sources are scaled to the cell size, whatever their encoded size. Their frame rate is left as it is, since the compositor outputs at the configured one anyway.
+    caps = gst_caps_new_simple("video/x-raw",
+                               "width", G_TYPE_INT, cell_width,
+                               "height", G_TYPE_INT, cell_height,
+                               nullptr);
+    g_object_set(capsfilter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    // FEC packets from clients sending them are used to recover lost packets, otherwise they pass through
+    init_fec_recovery(rtpstorage, rtpjitterbuffer, rtpulpfecdec);
+
+    jitterbuffer_configure(rtpjitterbuffer, source_jitterbuffer_mode);
+    // Retransmission requests would stop at the source element, since the server does not send NACKs to source clients
+    g_object_set(rtpjitterbuffer, "do-retransmission", false, nullptr);
+    g_signal_connect(rtpjitterbuffer, "request-pt-map", G_CALLBACK(jitterbuffer_request_pt_map), nullptr);
+
+    auto branch = new source_branch{};
+    branch->elements = {src, rtpstorage, rtpjitterbuffer, rtpulpfecdec, rtph264depay, avdec_h264};
+    branch->elements.insert(branch->elements.end(), converters.begin(), converters.end());
+    branch->elements.push_back(capsfilter);
+    branch->rtpjitterbuffer = rtpjitterbuffer;
+    branch->capsfilter = capsfilter;
+
+    for (auto element : branch->elements)
+    {
+        gst_bin_add(GST_BIN(pipeline), element);
+    }
+
+    if (is_in_process)
+    {
+        // format: time (3) – GST_FORMAT_TIME
+        // leaky-type: downstream (2) – Drop old buffers when the queue is full
+        // Buffers are timestamped on arrival, as udpsrc does
+        g_object_set(src, "is-live", true, "do-timestamp", true, "format", 3, "leaky-type", 2, nullptr);
+    }
+    else if (!init_udpsrc(src, branch->udpsrc_sockaddr))
+    {
+        gst_object_unref(compositor);
+        composite_pipeline_client_remove(pipeline, branch);
+        return nullptr;
+    }
+
+    for (size_t i = 1; i < branch->elements.size(); i++)
+    {
+        if (!gst_element_link(branch->elements[i - 1], branch->elements[i]))
+        {
+            g_printerr("Failed to link composite pipeline client elements.\n");
+            gst_object_unref(compositor);
+            composite_pipeline_client_remove(pipeline, branch);
+            return nullptr;
+        }
+    }
+
+    GstPad *capsfilter_src_pad = gst_element_get_static_pad(capsfilter, "src");
+    branch->compositor_pad = gst_element_request_pad_simple(compositor, "sink_%u");
+    gst_object_unref(compositor);
+    if (!branch->compositor_pad)
+    {
+        g_printerr("Failed to get compositor request sink pad.\n");
+        gst_object_unref(capsfilter_src_pad);
+        composite_pipeline_client_remove(pipeline, branch);
+        return nullptr;
+    }
+
+    if (gst_pad_link(capsfilter_src_pad, branch->compositor_pad) != GST_PAD_LINK_OK)
+    {
+        g_printerr("Failed to link capsfilter and compositor pads.\n");
+        gst_object_unref(capsfilter_src_pad);
+        composite_pipeline_client_remove(pipeline, branch);
+        return nullptr;
+    }
+
+    gst_object_unref(capsfilter_src_pad);
+
+    if (is_latency_measured)
+    {
+        frame_timings_attach(rtph264depay, &branch->timings);
+        gst_pad_add_probe(branch->compositor_pad, GST_PAD_PROBE_TYPE_BUFFER, compositor_sink_probe, branch, nullptr);
+    }
+
+    // Downstream elements first, so that no element pushes to a stopped one
+    for (auto element = branch->elements.rbegin(); element != branch->elements.rend(); element++)
+    {
+        gst_element_sync_state_with_parent(*element);
+    }
+
+    return branch;
+}
+
+/**
+ * Composite pipeline description: compositor name=compositor background=black zero-size-is-unscaled=false max-threads={compositor threads} ! queue leaky=downstream max-size-buffers=2 ! videobox autocrop=true ! capsfilter name=capsfilter caps="video/x-raw, width={cell width}, height={cell height}, framerate={framerate}/1" ! tee name=tee
+ * Rendition k sub-pipeline description: tee. ! queue leaky=downstream max-size-buffers=2 ! videoscale ! capsfilter name=rendition{k}_capsfilter ! x264enc name=rendition{k}_x264enc tune=zerolatency bitrate={bitrate} speed-preset=superfast threads={encoder threads} sliced-threads=true ! queue ! rtph264pay config-interval=-1 ! rtpulpfecenc pt=122 percentage={fec_percentage} ! udpsink host=127.0.0.1
+ * In-process rendition sub-pipeline description: ... ! rtpulpfecenc ! appsink
+ * In in-process mode, composite packets are queued to the rendition.
+ * The queues split the composite pipeline into stages, each with its own streaming thread: blending (the compositor aggregator thread), cropping, scaling and encoding per rendition, and payloading and sending per rendition, so that consecutive frames overlap in different stages. Within a stage, the compositor blends and x264enc encodes a frame across threads: with a thread budget (-t), half of it goes to the compositor and the other half is shared by the encoders, so that a room uses about as many threads as its budget, besides the streaming threads.
+ */
+GstElement *composite_pipeline_make(room &r)
+{
+    GstElement *pipeline = gst_pipeline_new("composite-pipeline");
+
+    GstElement *compositor = gst_element_factory_make("compositor", "compositor");
+    GstElement *composite_queue = gst_element_factory_make("queue", "composite_queue");
+    GstElement *videobox = gst_element_factory_make("videobox", "videobox");
+    GstElement *capsfilter = gst_element_factory_make("capsfilter", "capsfilter");
+    GstElement *tee = gst_element_factory_make("tee", "tee");
+
+    if (!pipeline || !compositor || !composite_queue || !videobox || !capsfilter || !tee)
+    {
+        g_printerr("Failed to create composite pipeline elements.\n");
+        return nullptr;
+    }
+
+    // background: black (1) – Black
+    g_object_set(compositor, "background", 1, "zero-size-is-unscaled", false, nullptr);
+    int encoder_threads = 0;
+    if (composite_threads > 0)
+    {
+        int compositor_threads = std::max(1, composite_threads / 2);
+        encoder_threads = std::max(1, (composite_threads - compositor_threads) / (int)r.renditions.size());
+        g_object_set(compositor, "max-threads", compositor_threads, nullptr);
+    }
+    // leaky: downstream (2) – Leaky on downstream (old buffers), so that the compositor blends the next frame while the current one is cropped and encoded, without frames piling up
+    g_object_set(composite_queue, "leaky", 2, "max-size-buffers", 2, nullptr);
+    g_object_set(videobox, "autocrop", true, nullptr);
+
+    auto size = composite_size(r);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "width", G_TYPE_INT, size.first,
+                                        "height", G_TYPE_INT, size.second,
+                                        "framerate", GST_TYPE_FRACTION, video_config.framerate, 1,
+                                        nullptr);
+    g_object_set(capsfilter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    gst_bin_add_many(GST_BIN(pipeline), compositor, composite_queue, videobox, capsfilter, tee, nullptr);
+
+    if (!gst_element_link_many(compositor, composite_queue, videobox, capsfilter, tee, nullptr))
+    {
+        g_printerr("Failed to link composite pipeline elements.\n");
+        gst_object_unref(pipeline);
+        return nullptr;
+    }
+
+    for (size_t k = 0; k < r.renditions.size(); k++)
+    {
+        auto &rend = *r.renditions[k];
+        std::string rendition_name = std::string("rendition") + std::to_string(k);
+
+        GstElement *queue = gst_element_factory_make("queue", (rendition_name + "_queue").c_str());
+        GstElement *videoscale = gst_element_factory_make("videoscale", (rendition_name + "_videoscale").c_str());
+        GstElement *rendition_capsfilter = gst_element_factory_make("capsfilter", (rendition_name + "_capsfilter").c_str());
+        GstElement *x264enc = gst_element_factory_make("x264enc", (rendition_name + "_x264enc").c_str());
+        GstElement *payload_queue = gst_element_factory_make("queue", (rendition_name + "_payload_queue").c_str());
+        GstElement *rtph264pay = gst_element_factory_make("rtph264pay", (rendition_name + "_rtph264pay").c_str());
+        GstElement *rtpulpfecenc = gst_element_factory_make("rtpulpfecenc", (rendition_name + "_rtpulpfecenc").c_str());
+        GstElement *sink;
+        if (is_in_process)
+        {
+            sink = gst_element_factory_make("appsink", (rendition_name + "_appsink").c_str());
+        }
+        else
+        {
+            sink = gst_element_factory_make("udpsink", (rendition_name + "_udpsink").c_str());
+        }
+
+        if (!queue || !videoscale || !rendition_capsfilter || !x264enc || !payload_queue || !rtph264pay || !rtpulpfecenc || !sink)
+        {
+            g_printerr("Failed to create composite pipeline rendition elements.\n");
+            gst_object_unref(pipeline);
+            return nullptr;
+        }
+
+        // leaky: downstream (2) – Leaky on downstream (old buffers), so that a slow encoder does not hold back the others
+        g_object_set(queue, "leaky", 2, "max-size-buffers", 2, nullptr);
+
+        // tune: zerolatency (0x00000004) – Zero latency
+        // bitrate: per rendition
+        // speed-preset: ultrafast (1) – ultrafast / superfast (2) – superfast
+        // threads: 0 – Automatic, without a thread budget
+        // sliced-threads: Each frame is split into slices encoded in parallel, which adds no frame of delay, unlike frame threads. Already implied by zerolatency, set so that it stays when the tune changes.
+        g_object_set(x264enc, "tune", 4, "bitrate", rendition_specs[k].bitrate, "speed-preset", 2, "threads", encoder_threads, "sliced-threads", true, nullptr);
+        // Encoded frames are not dropped, since the frames that follow would not decode without them
+        g_object_set(payload_queue, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", (guint64)GST_SECOND, nullptr);
+        // config-interval: -1 – Send SPS and PPS with every IDR frame, so that a joining sink can decode the first one
+        g_object_set(rtph264pay, "config-interval", -1, nullptr);
+        // mtu: Leaves room for the source capture times added to the first packet of each frame, within the default 1400 bytes
+        if (is_latency_measured)
+        {
+            g_object_set(rtph264pay, "mtu", (guint)(RTP_PAYLOADER_MTU - SOURCE_CAPTURE_TIMES_EXTENSION_MAX_LEN), nullptr);
+        }
+        // percentage: 0 – No FEC packets
+        g_object_set(rtpulpfecenc, "pt", FEC_PAYLOAD_TYPE, "percentage", fec_percentage, nullptr);
+        // Sources join at runtime, so the sink does not wait for preroll on state change
+        g_object_set(sink, "async", false, nullptr);
+
+        if (is_in_process)
+        {
+            GstAppSinkCallbacks callbacks{};
+            callbacks.new_sample = appsink_new_sample;
+            gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, &rend, nullptr);
+        }
+        else
+        {
+            g_object_set(sink, "host", "127.0.0.1", "port", rend.udpsink_port, nullptr);
+        }
+
+        gst_bin_add_many(GST_BIN(pipeline), queue, videoscale, rendition_capsfilter, x264enc, payload_queue, rtph264pay, rtpulpfecenc, sink, nullptr);
+
+        if (!gst_element_link_many(tee, queue, videoscale, rendition_capsfilter, x264enc, payload_queue, rtph264pay, rtpulpfecenc, sink, nullptr))
+        {
+            g_printerr("Failed to link composite pipeline rendition elements.\n");
+            gst_object_unref(pipeline);
+            return nullptr;
+        }
+
+        rend.capsfilter = rendition_capsfilter;
+        rend.x264enc = x264enc;
+        scale_rendition(r, rend);
+
+        if (is_latency_measured)
+        {
+            rend.composite_timings = &r.composite_timings;
+            GstPad *rtph264pay_src_pad = gst_element_get_static_pad(rtph264pay, "src");
+            gst_pad_add_probe(rtph264pay_src_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), rendition_rtph264pay_probe, &rend, nullptr);
+            gst_object_unref(rtph264pay_src_pad);
+        }
+    }
+
+    if (is_latency_measured)
+    {
+        GstPad *compositor_src_pad = gst_element_get_static_pad(compositor, "src");
+        gst_pad_add_probe(compositor_src_pad, GST_PAD_PROBE_TYPE_BUFFER, compositor_src_probe, &r, nullptr);
+        gst_object_unref(compositor_src_pad);
+    }
+
+    return pipeline;
+}
+
+/**
+ * Creates a composite pipeline client sub-pipeline at an unused source element index. Returns the index, or -1 if no more sources are allowed or the sub-pipeline could not be created.
+ */
+int source_branch_create(room &r)
+{
+    if (r.source_client_count >= max_sources)
+        return -1;
+
+    size_t src_ix;
+    if (r.src_ixs_available.empty())
+    {
+        std::lock_guard<std::mutex> lock(r.source_branches_mutex);
+        src_ix = r.source_branches.size();
+        r.source_branches.push_back(nullptr);
+    }
+    else
+    {
+        src_ix = r.src_ixs_available.back();
+        r.src_ixs_available.pop_back();
+    }
+
+    auto branch = composite_pipeline_client_add(r.pipeline, src_ix, r.cell_width, r.cell_height);
+    if (branch == nullptr)
+    {
+        r.src_ixs_available.push_back(src_ix);
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(r.source_branches_mutex);
+    r.source_branches[src_ix] = branch;
+    return src_ix;
+}
+
+void source_branch_destroy(room &r, size_t src_ix)
+{
+    auto branch = r.source_branches[src_ix];
+    {
+        std::lock_guard<std::mutex> lock(r.source_branches_mutex);
+        r.source_branches[src_ix] = nullptr;
+    }
+    composite_pipeline_client_remove(r.pipeline, branch);
+    r.src_ixs_available.push_back(src_ix);
+}
+
+/**
+ * Asks the encoder of a rendition for a keyframe, with SPS and PPS, through an upstream force-key-unit event.
+ */
+void rendition_keyframe_request(rendition &rend)
+{
+    GstPad *x264enc_src_pad = gst_element_get_static_pad(rend.x264enc, "src");
+    gst_pad_send_event(x264enc_src_pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, true, 0));
+    gst_object_unref(x264enc_src_pad);
+}
+
+// Interval of keyframe requests to a source client until its keyframe arrives, since requests may be lost, in microseconds
+const gint64 KEYFRAME_REQUEST_INTERVAL = 500000;
+
+/**
+ * Asks a source client for a keyframe over the control channel, so that its new sub-pipeline can start decoding.
+ */
+void client_keyframe_request(const sockaddr_in &client_sockaddr)
+{
+    char message[CONTROL_HEADER_LEN];
+    size_t message_len = control_keyframe_make(message);
+    if (sendto(server_sock, message, message_len, 0, (struct sockaddr *)&client_sockaddr, sizeof(client_sockaddr)) < 0)
+    {
+        std::cerr << "Failed to send keyframe request." << std::endl;
+    }
+}
+
+/**
+ * Caches a composite RTP packet of a rendition, overwriting the packet RETRANSMISSION_RING_SIZE sequence numbers older.
+ */
+void rendition_cache(rendition &rend, const char *data, size_t len)
+{
+    // RTP version 2 header
+    if (len < 12 || len > BUFFER_SIZE || ((uint8_t)data[0] >> 6) != 2)
+        return;
+
+    uint16_t seq = ((uint8_t)data[2] << 8) | (uint8_t)data[3];
+    uint32_t ssrc;
+    memcpy(&ssrc, data + 8, 4);
+    rend.ssrc = ntohl(ssrc);
+
+    auto &slot = rend.retransmission_ring[seq & (RETRANSMISSION_RING_SIZE - 1)];
+    slot.seq = seq;
+    memcpy(slot.data, data, len);
+    slot.len = len;
+}
+
+/**
+ * Records the arrival time of a source frame, when its first packet is routed to the source element.
+ */
+void source_ingress_record(frame_timings &timings, const char *data, size_t len, gint64 current_time)
+{
+    // RTP version 2 header, with the H.264 payload type
+    if (len < 12 || ((uint8_t)data[0] >> 6) != 2 || ((uint8_t)data[1] & 0x7f) == FEC_PAYLOAD_TYPE)
+        return;
+
+    uint32_t timestamp;
+    memcpy(&timestamp, data + 4, 4);
+    timestamp = ntohl(timestamp);
+
+    std::lock_guard<std::mutex> lock(timings.mutex);
+    if (timings.ingress_times.empty() || timings.ingress_times.back().first != timestamp)
+    {
+        frame_timings_push(timings.ingress_times, timestamp, current_time);
+    }
+}
+
+/**
+ * Measures the server latency of a rendition frame, from the arrival of its newest source frame, when the last packet of the frame is sent.
+ */
+void rendition_latency_measure(rendition &rend, const char *data, size_t len, gint64 current_time)
+{
+    // RTP version 2 header, with the marker bit, which is set on the last packet of a frame, and the H.264 payload type
+    if (len < 12 || ((uint8_t)data[0] >> 6) != 2 || !((uint8_t)data[1] & 0x80) || ((uint8_t)data[1] & 0x7f) == FEC_PAYLOAD_TYPE)
+        return;
+
+    uint32_t timestamp;
+    memcpy(&timestamp, data + 4, 4);
+    timestamp = ntohl(timestamp);
+
+    gint64 ingress_time;
+    {
+        std::lock_guard<std::mutex> lock(rend.timings.mutex);
+        if (!frame_timings_find(rend.timings.ingress_times, timestamp, ingress_time))
+            return;
+    }
+
+    gint64 latency = current_time - ingress_time;
+    rend.latency_sum += latency;
+    rend.latency_max = std::max(rend.latency_max, latency);
+    rend.latency_count++;
+}
+
+/**
+ * Prints the server latency of each rendition of a room since the previous report.
+ */
+void print_room_latency(room &r)
+{
+    std::lock_guard<std::mutex> lock(output_mutex);
+    for (size_t k = 0; k < r.renditions.size(); k++)
+    {
+        auto &rend = *r.renditions[k];
+        if (rend.latency_count == 0)
+            continue;
+        std::cout << "Server latency (room \"" << r.name << "\", rendition " << k << "): ";
+        std::cout << rend.latency_sum / rend.latency_count / 1000.0 << " ms average, " << rend.latency_max / 1000.0 << " ms maximum, over " << rend.latency_count << " frames" << std::endl;
+        rend.latency_sum = 0;
+        rend.latency_max = 0;
+        rend.latency_count = 0;
+    }
+}
+
+/**
+ * Retransmits a cached composite RTP packet of a rendition to a sink client, if it has not been overwritten yet.
+ */
+void rendition_retransmit(const rendition &rend, const sockaddr_in &client_sockaddr, uint32_t ssrc, uint16_t seq)
+{
+    const auto &slot = rend.retransmission_ring[seq & (RETRANSMISSION_RING_SIZE - 1)];
+    if (ssrc != rend.ssrc || slot.len == 0 || slot.seq != seq)
+        return;
+
+    stats.send_calls++;
+    if (sendto(server_sock, slot.data, slot.len, 0, (struct sockaddr *)&client_sockaddr, sizeof(client_sockaddr)) < 0)
+    {
+        std::cerr << "Failed to retransmit." << std::endl;
+        return;
+    }
+    stats.send_packets++;
+}
+
+/**
+ * Sends the server configuration to a client, in reply to its join message.
+ */
+void client_config_send(const sockaddr_in &client_sockaddr)
+{
+    char message[CONTROL_CONFIG_LEN];
+    size_t message_len = control_config_make(message, video_config);
+    if (sendto(server_sock, message, message_len, 0, (struct sockaddr *)&client_sockaddr, sizeof(client_sockaddr)) < 0)
+    {
+        std::cerr << "Failed to send config." << std::endl;
+    }
+}
+
+/**
+ * Sends the cell size of the room to a source client, so that it encodes its video at the size the composite shows it.
+ */
+void client_cell_send(const room &r, const sockaddr_in &client_sockaddr)
+{
+    char message[CONTROL_CELL_LEN];
+    size_t message_len = control_cell_make(message, r.cell_width, r.cell_height);
+    if (sendto(server_sock, message, message_len, 0, (struct sockaddr *)&client_sockaddr, sizeof(client_sockaddr)) < 0)
+    {
+        std::cerr << "Failed to send cell size." << std::endl;
+    }
+}
+
+/**
+ * Shrinks the cell size of a room so that its grid fits the maximum composite size, and grows it back up to the configured one as the grid shrinks. On change, moves and resizes the sources in the compositor and has them scaled to the new size. Returns whether the cell size changed.
+ */
+bool room_cells_fit(room &r)
+{
+    // With a fixed output size, cells fit the grid of the maximum number of sources, so that they never change size
+    auto grid = std::pair<uint8_t, uint8_t>{r.rows, r.cols};
+    if (is_fixed_output)
+    {
+        grow_position_cells(r, max_sources, video_config.cell_width, video_config.cell_height, (float)video_config.output_width / video_config.output_height);
+        grid = r.position_grids[max_sources - 1];
+    }
+    float fit = std::min({1.0f,
+                          (float)video_config.output_width / (video_config.cell_width * grid.second),
+                          (float)video_config.output_height / (video_config.cell_height * grid.first)});
+    uint16_t cell_width = std::max(2, (int)(video_config.cell_width * fit) & ~1);
+    uint16_t cell_height = std::max(2, (int)(video_config.cell_height * fit) & ~1);
+    if (cell_width == r.cell_width && cell_height == r.cell_height)
+        return false;
+    r.cell_width = cell_width;
+    r.cell_height = cell_height;
+
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "width", G_TYPE_INT, cell_width,
+                                        "height", G_TYPE_INT, cell_height,
+                                        nullptr);
+    for (size_t position = 0; position < r.position_src_ixs.size(); position++)
+    {
+        auto branch = r.source_branches[r.position_src_ixs[position]];
+        g_object_set(branch->capsfilter, "caps", caps, nullptr);
+        source_pad_place(r, branch->compositor_pad, position);
+    }
+    gst_caps_unref(caps);
+    return true;
+}
+
+/**
+ * Places a source client, which has just been given a source element, at the position after the ones in use, and asks it for a keyframe. The composite grid grows to include it in the next room update.
+ */
+void source_client_place(room &r, client_entry &client, size_t src_ix)
+{
+    client.roles |= CLIENT_ROLE_SOURCE;
+    client.src_ix = src_ix;
+    client.is_keyframe_awaited = true;
+    size_t position = source_position_take(r, src_ix);
+
+    r.source_client_count++;
+
+    source_pad_place(r, r.source_branches[src_ix]->compositor_pad, position);
+
+    client_keyframe_request(client.sockaddr);
+}
+
+/**
+ * Updates the activity time of the client that sent a packet and adds the client to the active clients of the room, if not active yet. Returns the index of the source element the packet should be routed to, or -1 if the client has no route.
+ * In SFU mode, returns 0 for source clients, whose packets are forwarded to the sink clients of the room.
+ */
+int client_packet_accept(room &r, const sockaddr_in &client_sockaddr, const char *data, size_t len, gint64 current_time, room_changes &changes)
+{
+    auto client = r.clients.find(client_sockaddr);
+
+    // If client is not an active client yet
+    if (client == nullptr)
+    {
+        // Add client to active clients
+        client = &r.clients.insert(client_sockaddr);
+        client->roles = CLIENT_ROLE_SINK;
+        client->rendition = 0;
+        client->rendition_min = 0;
+        client->report_time = 0;
+        client->uncongested_check_count = 0;
+        client->is_keyframe_awaited = false;
+
+        if (!is_sfu)
+        {
+            r.renditions[client->rendition]->is_keyframe_needed = true;
+        }
+
+        changes.has_addition_occurred = true;
+    }
+
+    // Clients join before sending video, so they become sources on their first video packet rather than on their first packet
+    bool is_video = len > 0 && !control_message_is(data, len) && !(client->roles & (CLIENT_ROLE_SOURCE | CLIENT_ROLE_HIDDEN_SOURCE));
+    // Video data received, in SFU mode, where source clients only take a slot
+    if (is_sfu && is_video && r.source_client_count < max_sources)
+    {
+        client->roles |= CLIENT_ROLE_SOURCE;
+        client->src_ix = 0;
+        r.source_client_count++;
+        changes.has_source_addition_occurred = true;
+    }
+
+    // Video data received and a sub-pipeline created for the client
+    // This is not entered when a keepalive or control message is received (e.g. from a receive-only client) or the maximum number of sources is reached
+    int src_ix;
+    if (!is_sfu && is_video && ((src_ix = source_branch_create(r)) != -1))
+    {
+        source_client_place(r, *client, src_ix);
+
+        changes.has_source_addition_occurred = true;
+    }
+    // Beyond the maximum number of sources, the source client stays hidden, without a sub-pipeline to decode its video data, until a source element becomes available
+    else if (!is_sfu && is_video && r.source_client_count >= max_sources)
+    {
+        client->roles |= CLIENT_ROLE_HIDDEN_SOURCE;
+        r.hidden_sources.push_back(client_sockaddr);
+    }
+
+    // Update client activity time
+    client->activity = current_time;
+    client->recv_packets++;
+    client->recv_bytes += len;
+
+    // Join messages carry the rendition requested by the client, which adaptation may lower
+    if (control_message_is(data, len) && control_message_type(data) == CONTROL_JOIN)
+    {
+        client_config_send(client_sockaddr);
+        // Repeated with every join message, in case the one sent on a layout change was lost
+        if (!is_sfu && (client->roles & CLIENT_ROLE_SOURCE))
+        {
+            client_cell_send(r, client_sockaddr);
+        }
+
+        // Renditions only exist in composite mode
+        if (!is_sfu)
+        {
+            client->rendition_min = std::min<size_t>(control_join_rendition(data, len), r.renditions.size() - 1);
+            auto rendition = client->rendition;
+            client->rendition = is_adaptive ? std::max(client->rendition, client->rendition_min) : client->rendition_min;
+            if (client->rendition != rendition)
+            {
+                r.renditions[client->rendition]->is_keyframe_needed = true;
+            }
+        }
+    }
+    else if (control_message_is(data, len) && control_message_type(data) == CONTROL_REPORT)
+    {
+        if (control_report_parse(data, len, client->report))
+        {
+            client->report_time = current_time;
+        }
+    }
+    else if (control_message_is(data, len) && control_message_type(data) == CONTROL_NACK && !is_sfu)
+    {
+        uint32_t ssrc;
+        uint16_t seq;
+        if (control_nack_parse(data, len, ssrc, seq))
+        {
+            rendition_retransmit(*r.renditions[client->rendition], client_sockaddr, ssrc, seq);
+        }
+    }
+
+    // If a client route exists, the packet is routed to the associated source element, starting from a keyframe
+    if (client->roles & CLIENT_ROLE_SOURCE)
+    {
+        if (client->is_keyframe_awaited && !control_message_is(data, len))
+        {
+            if (!rtp_h264_keyframe_starts(data, len))
+                return -1;
+            client->is_keyframe_awaited = false;
+        }
+        return client->src_ix;
+    }
+    return -1;
+}
+
+/**
+ * Datagram buffers and message headers for receiving with recvmmsg.
+ */
+struct recv_batch
+{
+    mmsghdr msgs[BATCH_SIZE];
+    iovec iovecs[BATCH_SIZE];
+    sockaddr_in sockaddrs[BATCH_SIZE];
+    char buffers[BATCH_SIZE][BUFFER_SIZE];
+};
+
+void recv_batch_init(recv_batch &batch)
+{
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        batch.iovecs[i].iov_base = batch.buffers[i];
+        batch.msgs[i].msg_hdr = msghdr{};
+        batch.msgs[i].msg_hdr.msg_iov = &(batch.iovecs[i]);
+        batch.msgs[i].msg_hdr.msg_iovlen = 1;
+        batch.msgs[i].msg_hdr.msg_name = &(batch.sockaddrs[i]);
+    }
+}
+
+/**
+ * Receives up to BATCH_SIZE pending datagrams with a single recvmmsg call, without blocking. Returns the number of datagrams received, or -1 on error.
+ */
+int recv_batch_recv(int sock, recv_batch &batch)
+{
+    // Lengths are overwritten by each call, so they are reset here
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        batch.iovecs[i].iov_len = BUFFER_SIZE;
+        batch.msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+
+    int msg_count = recvmmsg(sock, batch.msgs, BATCH_SIZE, MSG_DONTWAIT, nullptr);
+    if (msg_count > 0)
+    {
+        stats.recv_calls++;
+        stats.recv_packets += msg_count;
+    }
+    return msg_count;
+}
+
+/**
+ * Receives a single datagram into the first buffer of the batch, so that both receive modes are handled alike. Returns 1, or -1 on error.
+ */
+int recv_batch_recv_one(int sock, recv_batch &batch)
+{
+    socklen_t sockaddr_len = sizeof(sockaddr_in);
+    ssize_t bytes_read = recvfrom(sock, batch.buffers[0], BUFFER_SIZE, 0, (struct sockaddr *)&(batch.sockaddrs[0]), &sockaddr_len);
+    if (bytes_read < 0)
+        return -1;
+    batch.msgs[0].msg_len = bytes_read;
+    stats.recv_calls++;
+    stats.recv_packets++;
+    return 1;
+}
+
+#ifdef HAVE_LIBURING
+// Submission queue size of the io_uring rings of a relay thread
+const unsigned URING_ENTRIES = 256;
+// Receive buffers provided to the kernel per relay thread, a power of two, and their buffer group ID
+const unsigned URING_BUFFER_COUNT = 256;
+const int URING_BUFFER_GROUP = 0;
+
+/**
+ * io_uring relay state of a relay thread. Multishot receives complete on the receive ring, whose file descriptor the relay loop polls, into buffers the kernel picks from the provided buffer ring. Sends go through their own ring, so that waiting for their completion consumes no receive completions.
+ */
+struct uring_relay
+{
+    io_uring recv_ring;
+    io_uring send_ring;
+    io_uring_buf_ring *buf_ring = nullptr;
+    std::vector<char> buffers = std::vector<char>(URING_BUFFER_COUNT * BUFFER_SIZE);
+
+    // Receive message template, which tells the kernel how much room to leave for the source address in each buffer
+    msghdr recv_msg{};
+
+    // Buffers handled since they were last given back to the kernel
+    std::vector<unsigned short> buffer_ids;
+
+    ~uring_relay()
+    {
+        if (buf_ring)
+        {
+            io_uring_free_buf_ring(&recv_ring, buf_ring, URING_BUFFER_COUNT, URING_BUFFER_GROUP);
+            io_uring_queue_exit(&send_ring);
+            io_uring_queue_exit(&recv_ring);
+        }
+    }
+};
+
+// io_uring relay state of the current relay thread, nullptr with the poll backend
+thread_local uring_relay *uring = nullptr;
+
+/**
+ * Gives the handled buffers back to the kernel.
+ */
+void uring_buffers_recycle(uring_relay &u)
+{
+    int mask = io_uring_buf_ring_mask(URING_BUFFER_COUNT);
+    for (size_t i = 0; i < u.buffer_ids.size(); i++)
+    {
+        auto buffer_id = u.buffer_ids[i];
+        io_uring_buf_ring_add(u.buf_ring, u.buffers.data() + buffer_id * BUFFER_SIZE, BUFFER_SIZE, buffer_id, mask, i);
+    }
+    io_uring_buf_ring_advance(u.buf_ring, u.buffer_ids.size());
+    u.buffer_ids.clear();
+}
+
+/**
+ * Sets up the rings and provides all buffers to the kernel. Returns false on error.
+ */
+bool uring_relay_init(uring_relay &u)
+{
+    if (io_uring_queue_init(URING_ENTRIES, &u.recv_ring, 0) < 0)
+        return false;
+    if (io_uring_queue_init(URING_ENTRIES, &u.send_ring, 0) < 0)
+    {
+        io_uring_queue_exit(&u.recv_ring);
+        return false;
+    }
+
+    int ret;
+    u.buf_ring = io_uring_setup_buf_ring(&u.recv_ring, URING_BUFFER_COUNT, URING_BUFFER_GROUP, 0, &ret);
+    if (u.buf_ring == nullptr)
+    {
+        io_uring_queue_exit(&u.send_ring);
+        io_uring_queue_exit(&u.recv_ring);
+        return false;
+    }
+
+    for (unsigned i = 0; i < URING_BUFFER_COUNT; i++)
+    {
+        u.buffer_ids.push_back(i);
+    }
+    uring_buffers_recycle(u);
+
+    u.recv_msg.msg_namelen = sizeof(sockaddr_in);
+    return true;
+}
+
+/**
+ * Sets up the io_uring relay state of the current relay thread, which runs for the lifetime of the process. Returns false on error.
+ */
+bool uring_thread_init()
+{
+    auto u = std::make_unique<uring_relay>();
+    if (!uring_relay_init(*u))
+    {
+        std::cerr << "Failed to set up io_uring." << std::endl;
+        return false;
+    }
+    uring = u.release();
+    return true;
+}
+
+/**
+ * Returns a submission queue entry, submitting the queued ones first if the submission queue is full.
+ */
+io_uring_sqe *uring_sqe_get(io_uring &ring)
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr)
+    {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+/**
+ * Arms a multishot receive on a socket, whose completions carry the given user data. It keeps completing until cancelled, or until it runs out of provided buffers or of completion queue room, in which case its last completion lacks IORING_CQE_F_MORE and it must be armed again.
+ */
+void uring_recv_arm(uring_relay &u, int sock, void *user_data)
+{
+    io_uring_sqe *sqe = uring_sqe_get(u.recv_ring);
+    io_uring_prep_recvmsg_multishot(sqe, sock, &u.recv_msg, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    io_uring_sqe_set_data(sqe, user_data);
+    io_uring_submit(&u.recv_ring);
+}
+
+/**
+ * Cancels the multishot receive on a socket, whose last completion follows. The completion of the cancellation itself carries no user data.
+ */
+void uring_recv_cancel(uring_relay &u, int sock)
+{
+    io_uring_sqe *sqe = uring_sqe_get(u.recv_ring);
+    io_uring_prep_cancel_fd(sqe, sock, 0);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(&u.recv_ring);
+}
+
+/**
+ * Locates the datagram and its source address in the buffer of a receive completion, and marks the buffer as handled. The datagram is valid until the buffers are recycled. Returns false if the completion carries no complete datagram.
+ */
+bool uring_recv_parse(uring_relay &u, const io_uring_cqe *cqe, char *&data, size_t &len, sockaddr_in *&sockaddr)
+{
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return false;
+
+    unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    u.buffer_ids.push_back(buffer_id);
+
+    auto out = io_uring_recvmsg_validate(u.buffers.data() + buffer_id * BUFFER_SIZE, cqe->res, &u.recv_msg);
+    if (out == nullptr || (out->flags & MSG_TRUNC))
+        return false;
+
+    sockaddr = (sockaddr_in *)io_uring_recvmsg_name(out);
+    data = (char *)io_uring_recvmsg_payload(out, &u.recv_msg);
+    len = io_uring_recvmsg_payload_length(out, cqe->res, &u.recv_msg);
+    return true;
+}
+
+/**
+ * Tells whether a receive completion is the last one of a multishot receive that was neither cancelled nor failed for good, so that it must be armed again.
+ */
+bool uring_recv_is_rearm_needed(const io_uring_cqe *cqe)
+{
+    return !(cqe->flags & IORING_CQE_F_MORE) && (cqe->res >= 0 || cqe->res == -ENOBUFS);
+}
+
+/**
+ * Sends all messages with io_uring, submitting as many per io_uring_enter call as the submission queue holds, and waits for their completion, since the data they point to is only valid until this returns. A message that fails to be sent is skipped. The iovec pointers are assigned here, as in send_msgs_send.
+ */
+void uring_send_msgs(uring_relay &u, int sock, std::vector<mmsghdr> &msgs, std::vector<iovec> &iovecs)
+{
+    size_t msgs_sent = 0;
+    while (msgs_sent < msgs.size())
+    {
+        unsigned msg_count = 0;
+        io_uring_sqe *sqe;
+        while (msgs_sent + msg_count < msgs.size() && (sqe = io_uring_get_sqe(&u.send_ring)) != nullptr)
+        {
+            auto &msg = msgs[msgs_sent + msg_count].msg_hdr;
+            msg.msg_iov = &(iovecs[msgs_sent + msg_count]);
+            io_uring_prep_sendmsg(sqe, sock, &msg, 0);
+            msg_count++;
+        }
+
+        io_uring_submit_and_wait(&u.send_ring, msg_count);
+        stats.send_calls++;
+
+        for (unsigned i = 0; i < msg_count; i++)
+        {
+            io_uring_cqe *cqe;
+            int ret;
+            while ((ret = io_uring_wait_cqe(&u.send_ring, &cqe)) == -EINTR)
+            {
+            }
+            if (ret < 0)
+            {
+                std::cerr << "Failed to wait for send completion." << std::endl;
+                break;
+            }
+            if (cqe->res < 0)
+            {
+                std::cerr << "Failed to send." << std::endl;
+            }
+            else
+            {
+                stats.send_packets++;
+            }
+            io_uring_cqe_seen(&u.send_ring, cqe);
+        }
+        msgs_sent += msg_count;
+    }
+}
+
+/**
+ * Checks that the kernel supports what the io_uring backend needs, provided buffer rings and multishot receives (Linux 6.0 or later), by receiving a datagram sent to a loopback socket.
+ */
+bool uring_probe()
+{
+    uring_relay u;
+    if (!uring_relay_init(u))
+        return false;
+
+    sockaddr_in sockaddr;
+    int sock = loopback_sock_make(sockaddr);
+    if (sock < 0)
+        return false;
+
+    uring_recv_arm(u, sock, &u);
+
+    bool is_supported = false;
+    char probe = 0;
+    io_uring_cqe *cqe;
+    __kernel_timespec timeout{1, 0};
+    if (sendto(sock, &probe, sizeof(probe), 0, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == sizeof(probe) && io_uring_wait_cqe_timeout(&u.recv_ring, &cqe, &timeout) == 0)
+    {
+        is_supported = cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE);
+        io_uring_cqe_seen(&u.recv_ring, cqe);
+    }
+
+    uring_recv_cancel(u, sock);
+    close(sock);
+    return is_supported;
+}
+#endif
+
+/**
+ * Adds a message for sending the given data to the given address. The data and the address must outlive the sendmmsg call.
+ */
+void send_msgs_add(std::vector<mmsghdr> &msgs, std::vector<iovec> &iovecs, void *data, size_t len, const sockaddr_in *sockaddr)
+{
+    mmsghdr msg{};
+    msg.msg_hdr.msg_name = (void *)sockaddr;
+    msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    msg.msg_hdr.msg_iovlen = 1;
+    msgs.push_back(msg);
+    iovecs.push_back({data, len});
+}
+
+/**
+ * Sends all messages with as few sendmmsg calls as possible, or, with the io_uring backend, through the send ring. A message that fails to be sent is skipped. The iovec pointers are assigned here, since the iovecs vector may have been reallocated while adding messages.
+ */
+void send_msgs_send(int sock, std::vector<mmsghdr> &msgs, std::vector<iovec> &iovecs)
+{
+#ifdef HAVE_LIBURING
+    if (uring)
+    {
+        uring_send_msgs(*uring, sock, msgs, iovecs);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        msgs[i].msg_hdr.msg_iov = &(iovecs[i]);
+    }
+
+    size_t msgs_sent = 0;
+    while (msgs_sent < msgs.size())
+    {
+        int msg_count = sendmmsg(sock, msgs.data() + msgs_sent, msgs.size() - msgs_sent, 0);
+        stats.send_calls++;
+        if (msg_count < 0)
+        {
+            std::cerr << "Failed to send batch." << std::endl;
+            // Skip the message that caused the error
+            msgs_sent++;
+            continue;
+        }
+        stats.send_packets += msg_count;
+        msgs_sent += msg_count;
+    }
+}
+
+/**
+ * Run of consecutive queued packets of equal size, possibly followed by a smaller one, sent as a single datagram with UDP_SEGMENT.
+ */
+struct gso_run
+{
+    size_t offset;
+    size_t len;
+    uint16_t segment_size;
+    uint16_t segment_count;
+};
+
+/**
+ * Control data of a message in GSO and pacing modes: the UDP_SEGMENT segment size, 0 for a single packet, and the SO_TXTIME departure time, 0 for none.
+ */
+struct msg_control
+{
+    uint16_t segment_size;
+    gint64 departure_time;
+};
+
+// Control message buffer with room for both control messages
+union msg_control_buf
+{
+    char buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    cmsghdr align;
+};
+
+/**
+ * Attaches the control messages of each message. The control pointers are assigned just before sending, like the iovec pointers.
+ */
+void send_msgs_control(std::vector<mmsghdr> &msgs, std::vector<msg_control_buf> &bufs, const std::vector<msg_control> &controls)
+{
+    bufs.resize(msgs.size());
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        auto &msg = msgs[i].msg_hdr;
+        msg.msg_control = bufs[i].buf;
+        msg.msg_controllen = sizeof(bufs[i].buf);
+        size_t controllen = 0;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (controls[i].segment_size > 0)
+        {
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &controls[i].segment_size, sizeof(uint16_t));
+            controllen += CMSG_SPACE(sizeof(uint16_t));
+            cmsg = CMSG_NXTHDR(&msg, cmsg);
+        }
+        if (controls[i].departure_time > 0)
+        {
+            // The socket clock is CLOCK_MONOTONIC, as is g_get_monotonic_time(), in nanoseconds
+            uint64_t txtime = controls[i].departure_time * 1000;
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+            memcpy(CMSG_DATA(cmsg), &txtime, sizeof(uint64_t));
+            controllen += CMSG_SPACE(sizeof(uint64_t));
+        }
+        msg.msg_control = controllen > 0 ? bufs[i].buf : nullptr;
+        msg.msg_controllen = controllen;
+    }
+}
+
+// Userspace pacer timer wheel: slot duration, and slot count, which bounds how far ahead packets are held
+const gint64 PACER_SLOT_DURATION = 1000;
+const size_t PACER_SLOT_COUNT = 1024;
+
+/**
+ * Packet held by the pacer, stored in the data of its slot.
+ */
+struct paced_packet
+{
+    sockaddr_in sockaddr;
+    size_t offset;
+    size_t len;
+    uint16_t segment_size;
+};
+
+struct pacer_slot
+{
+    std::vector<paced_packet> packets;
+    std::vector<char> data;
+};
+
+/**
+ * Timer wheel of the packets held by a worker until their departure times, in slots of PACER_SLOT_DURATION. Packets due further ahead than the wheel spans go to its last slot.
+ */
+struct pacer
+{
+    std::vector<pacer_slot> slots = std::vector<pacer_slot>(PACER_SLOT_COUNT);
+    // Start time of the next slot to release
+    gint64 time = 0;
+    size_t packet_count = 0;
+};
+
+/**
+ * Holds a copy of a packet in the slot of its departure time.
+ */
+void pacer_schedule(pacer &p, gint64 departure_time, const char *data, size_t len, const sockaddr_in &sockaddr, uint16_t segment_size)
+{
+    gint64 slot_time = std::clamp(departure_time, p.time, p.time + (gint64)(PACER_SLOT_COUNT - 1) * PACER_SLOT_DURATION);
+    auto &slot = p.slots[(slot_time / PACER_SLOT_DURATION) % PACER_SLOT_COUNT];
+    slot.packets.push_back({sockaddr, slot.data.size(), len, segment_size});
+    slot.data.insert(slot.data.end(), data, data + len);
+    p.packet_count++;
+}
+
+/**
+ * Returns the poll timeout, in milliseconds, until the next slot of the pacer to release, or the given one if the pacer holds no packets.
+ */
+int pacer_timeout(const pacer &p, gint64 current_time, int timeout)
+{
+    if (p.packet_count == 0)
+        return timeout;
+    return std::clamp((int)((p.time - current_time + 999) / 1000), 0, timeout);
+}
+
+/**
+ * Sends a datagram with sendto, or, in batched relay mode or with the io_uring backend, adds it to the messages to send.
+ */
+void relay_send(std::vector<mmsghdr> &msgs, std::vector<iovec> &iovecs, void *data, size_t len, const sockaddr_in *sockaddr)
+{
+    if (is_batched || is_uring)
+    {
+        send_msgs_add(msgs, iovecs, data, len, sockaddr);
+        return;
+    }
+
+    // Sending from server_sock whatever the shard of the client is safe: concurrent sends on a UDP socket do not interleave, and all shard sockets are bound to the server port, so clients see the same source address. It is also the only socket set up for SO_TXTIME.
+    stats.send_calls++;
+    if (sendto(server_sock, data, len, 0, (struct sockaddr *)sockaddr, sizeof(sockaddr_in)) < 0)
+    {
+        std::cerr << "Failed to send." << std::endl;
+        return;
+    }
+    stats.send_packets++;
+}
+
+/**
+ * Client counters and latest receiver report, as published for the metrics endpoint.
+ */
+struct client_metrics
+{
+    std::string room_name;
+    sockaddr_in sockaddr;
+    uint8_t roles;
+    uint64_t recv_packets;
+    uint64_t recv_bytes;
+    uint64_t send_packets;
+    uint64_t send_bytes;
+    // Latest receiver report, if any
+    bool has_report;
+    receiver_report report;
+};
+
+/**
+ * Worker thread state. Each worker owns a set of rooms and runs their relay loops.
+ */
+struct worker
+{
+    size_t ix;
+    std::thread thread;
+
+    // Rooms handed over by the router, to be opened or closed by the worker
+    std::vector<std::shared_ptr<room>> rooms_added;
+    std::vector<std::shared_ptr<room>> rooms_removed;
+    std::mutex rooms_mutex;
+
+    // Signaled when rooms are handed over
+    int rooms_eventfd = -1;
+
+    // Rooms owned by the worker thread
+    std::vector<std::shared_ptr<room>> rooms;
+
+    // Relay loop buffers
+    std::unique_ptr<recv_batch> composite_batch = std::make_unique<recv_batch>();
+    std::vector<mmsghdr> route_msgs;
+    std::vector<iovec> route_iovecs;
+    std::vector<mmsghdr> fanout_msgs;
+    std::vector<iovec> fanout_iovecs;
+    std::vector<inbox_packet> inbox_packets;
+    std::vector<char> inbox_data;
+    std::vector<GstBuffer *> composite_buffers;
+    std::vector<GstMapInfo> composite_maps;
+
+    // Renditions of closed rooms whose multishot receives have not completed for the last time yet, and the renditions whose receives have, with whether to arm them again (io_uring backend only)
+    std::vector<std::unique_ptr<rendition>> renditions_closing;
+    std::vector<std::pair<rendition *, bool>> uring_recvs_ended;
+
+    // Renditions with queued composite packets, egress queues taken from renditions until their messages are sent, and their runs (GSO mode only)
+    std::vector<rendition *> egress_renditions;
+    std::vector<std::vector<char>> egress_frames;
+    std::vector<gso_run> egress_runs;
+
+    // Control data of each fan-out message (GSO and pacing modes only)
+    std::vector<msg_control> fanout_controls;
+    std::vector<msg_control_buf> fanout_control_bufs;
+
+    // Packets held until their departure times (userspace pacing only)
+    pacer egress_pacer;
+
+    // Snapshot of the client counters of the rooms, published by the worker for the metrics endpoint
+    std::vector<client_metrics> client_metrics_snapshot;
+    std::mutex client_metrics_mutex;
+};
+
+/**
+ * Sets up the composite pipeline and the egress paths of a room. Runs on the worker owning the room.
+ */
+bool room_open(room &r)
+{
+    r.client_activity_check = g_get_monotonic_time();
+
+    // In SFU mode, rooms have no composite pipeline
+    if (is_sfu)
+        return true;
+
+    for (const auto &spec : rendition_specs)
+    {
+        r.renditions.push_back(std::make_unique<rendition>());
+        auto &rend = *r.renditions.back();
+        rend.owner = &r;
+        rend.rendition_ix = r.renditions.size() - 1;
+        rend.scale = spec.scale;
+        rend.bitrate = spec.bitrate;
+        rend.max_bitrate = spec.bitrate;
+
+        if (is_in_process)
+        {
+            rend.appsink_eventfd = eventfd(0, 0);
+            if (rend.appsink_eventfd < 0)
+            {
+                std::cerr << "Failed to create appsink_eventfd." << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            sockaddr_in udpsink_sockaddr;
+            rend.udpsink_sock = loopback_sock_make(udpsink_sockaddr);
+            if (rend.udpsink_sock < 0)
+            {
+                std::cerr << "Failed to create udpsink_sock." << std::endl;
+                return false;
+            }
+            rend.udpsink_port = ntohs(udpsink_sockaddr.sin_port);
+        }
+    }
+
+    // Sources are composited at their final cell size from the start
+    if (is_fixed_output)
+    {
+        room_cells_fit(r);
+    }
+
+    r.pipeline = composite_pipeline_make(r);
+    if (r.pipeline == nullptr)
+        return false;
+
+    r.capsfilter = gst_bin_get_by_name(GST_BIN(r.pipeline), "capsfilter");
+
+    gst_element_set_state(r.pipeline, GST_STATE_PLAYING);
+
+    return true;
+}
+
+/**
+ * Stops the composite pipeline of a room and releases its resources. Runs on the worker owning the room.
+ */
+void room_close(room &r)
+{
+    if (r.pipeline)
+    {
+        gst_element_set_state(r.pipeline, GST_STATE_NULL);
+        for (size_t src_ix = 0; src_ix < r.source_branches.size(); src_ix++)
+        {
+            if (r.source_branches[src_ix])
+            {
+                source_branch_destroy(r, src_ix);
+            }
+        }
+        gst_object_unref(r.capsfilter);
+        gst_object_unref(r.pipeline);
+        r.pipeline = nullptr;
+    }
+
+    for (auto &rend : r.renditions)
+    {
+        for (auto buffer : rend->appsink_buffers)
+        {
+            gst_buffer_unref(buffer);
+        }
+        if (rend->udpsink_sock >= 0)
+            close(rend->udpsink_sock);
+        if (rend->appsink_eventfd >= 0)
+            close(rend->appsink_eventfd);
+    }
+    r.renditions.clear();
+}
+
+/**
+ * Counts packets sent to a client, for the metrics endpoint.
+ */
+void client_send_count(client_entry &client, size_t len, size_t packet_count)
+{
+    client.send_packets += packet_count;
+    client.send_bytes += len;
+    if (metrics)
+    {
+        counter_add(metrics->egress_packets, packet_count);
+        counter_add(metrics->egress_bytes, len);
+    }
+}
+
+/**
+ * Handles the client packets routed to a room: updates its clients and routes video data to the GStreamer pipeline.
+ */
+void room_route_inbox(room &r, worker &w, gint64 current_time, room_changes &changes)
+{
+    uint64_t count;
+    if (read(r.inbox_eventfd, &count, sizeof(count)) < 0)
+    {
+        std::cerr << "Failed to read inbox_eventfd." << std::endl;
+        return;
+    }
+
+    w.inbox_packets.clear();
+    w.inbox_data.clear();
+    {
+        std::lock_guard<std::mutex> lock(r.inbox_mutex);
+        std::swap(w.inbox_packets, r.inbox_packets);
+        std::swap(w.inbox_data, r.inbox_data);
+    }
+
+    w.route_msgs.clear();
+    w.route_iovecs.clear();
+    for (const auto &packet : w.inbox_packets)
+    {
+        char *data = w.inbox_data.data() + packet.offset;
+        auto src_ix = client_packet_accept(r, packet.sockaddr, data, packet.len, current_time, changes);
+        if (src_ix == -1 || control_message_is(data, packet.len))
+            continue;
+
+        // Forward to all other sink clients, which demultiplex the sources by SSRC
+        if (is_sfu)
+        {
+            for (auto &client : r.clients.entries)
+            {
+                if ((client.roles & CLIENT_ROLE_SINK) && (client.sockaddr.sin_addr.s_addr != packet.sockaddr.sin_addr.s_addr || client.sockaddr.sin_port != packet.sockaddr.sin_port))
+                {
+                    relay_send(w.route_msgs, w.route_iovecs, data, packet.len, &client.sockaddr);
+                    client_send_count(client, packet.len, 1);
+                }
+            }
+            continue;
+        }
+
+        // Route to the associated appsrc or udpsrc_sockaddr
+        auto branch = r.source_branches[src_ix];
+        if (is_latency_measured)
+        {
+            source_ingress_record(branch->timings, data, packet.len, current_time);
+        }
+        if (is_in_process)
+        {
+            appsrc_push(branch->elements.front(), data, packet.len);
+        }
+        else
+        {
+            relay_send(w.route_msgs, w.route_iovecs, data, packet.len, &(branch->udpsrc_sockaddr));
+        }
+        if (metrics)
+        {
+            counter_add(metrics->route_packets, 1);
+        }
+    }
+
+    if (!w.route_msgs.empty())
+    {
+        send_msgs_send(server_sock, w.route_msgs, w.route_iovecs);
+    }
+}
+
+/**
+ * Returns the departure time of a packet to a sink client and advances the pacing of the client: a token bucket filled at pacing_multiple times the bitrate of the rendition, holding up to PACING_BURST_DURATION worth of tokens.
+ */
+gint64 client_pace(client_entry &client, const rendition &rend, size_t len, gint64 current_time)
+{
+    gint64 departure_time = std::max(client.pacing_time, current_time - PACING_BURST_DURATION);
+    // Bytes to microseconds at a rate in kbit/s
+    client.pacing_time = departure_time + (gint64)(len * 8000 / (pacing_multiple * rend.bitrate));
+    return departure_time;
+}
+
+/**
+ * Adds a message to a sink client to the fan-out messages, with its control data, or, if it is paced by the worker and not due yet, holds it in the pacer.
+ */
+void worker_fanout_add(worker &w, client_entry &client, const rendition &rend, char *data, size_t len, uint16_t segment_size, size_t packet_count, gint64 current_time)
+{
+    client_send_count(client, len, packet_count);
+    gint64 departure_time = pacing_multiple > 0 ? client_pace(client, rend, len, current_time) : 0;
+    if (departure_time > current_time && !is_txtime)
+    {
+        pacer_schedule(w.egress_pacer, departure_time, data, len, client.sockaddr, segment_size);
+        return;
+    }
+    send_msgs_add(w.fanout_msgs, w.fanout_iovecs, data, len, &client.sockaddr);
+    w.fanout_controls.push_back({segment_size, is_txtime ? departure_time : 0});
+}
+
+/**
+ * Sends composite packets of a rendition to the sink clients of a room that receive it.
+ */
+void room_fanout(room &r, worker &w, size_t rendition_ix, void *data, size_t len, gint64 current_time)
+{
+    for (auto &client : r.clients.entries)
+    {
+        if ((client.roles & CLIENT_ROLE_SINK) && client.rendition == rendition_ix)
+        {
+            if (pacing_multiple > 0)
+            {
+                worker_fanout_add(w, client, *r.renditions[rendition_ix], (char *)data, len, 0, 1, current_time);
+                continue;
+            }
+            relay_send(w.fanout_msgs, w.fanout_iovecs, data, len, &client.sockaddr);
+            client_send_count(client, len, 1);
+        }
+    }
+}
+
+/**
+ * Splits the egress queue of a rendition into runs, each sent as one datagram that the kernel segments back into the queued packets, and adds a message per run for each sink client of the rendition. The queue is handed to the worker until the messages are sent.
+ */
+void room_fanout_frame(room &r, worker &w, rendition &rend, gint64 current_time)
+{
+    // With pacing, a run leaves at once, so it is kept within the burst allowance
+    size_t max_run_len = pacing_multiple > 0 ? std::max((size_t)(pacing_multiple * rend.bitrate * PACING_BURST_DURATION / 8000), (size_t)BUFFER_SIZE) : GSO_MAX_BYTES;
+    w.egress_runs.clear();
+    size_t offset = 0;
+    size_t i = 0;
+    while (i < rend.egress_lens.size())
+    {
+        gso_run run{offset, 0, (uint16_t)rend.egress_lens[i], 0};
+        while (i < rend.egress_lens.size() && run.segment_count < GSO_MAX_SEGMENTS && run.len + rend.egress_lens[i] <= std::min(max_run_len, GSO_MAX_BYTES) && rend.egress_lens[i] <= run.segment_size)
+        {
+            // Only the last segment may be smaller
+            bool is_last = rend.egress_lens[i] < run.segment_size;
+            run.len += rend.egress_lens[i];
+            run.segment_count++;
+            i++;
+            if (is_last)
+                break;
+        }
+        offset += run.len;
+        w.egress_runs.push_back(run);
+    }
+
+    w.egress_frames.emplace_back();
+    std::swap(w.egress_frames.back(), rend.egress_data);
+    rend.egress_lens.clear();
+    char *frame = w.egress_frames.back().data();
+
+    for (auto &client : r.clients.entries)
+    {
+        if ((client.roles & CLIENT_ROLE_SINK) && client.rendition == rend.rendition_ix)
+        {
+            for (const auto &run : w.egress_runs)
+            {
+                // A single packet is sent as it is
+                worker_fanout_add(w, client, rend, frame + run.offset, run.len, run.segment_count > 1 ? run.segment_size : 0, run.segment_count, current_time);
+            }
+        }
+    }
+}
+
+/**
+ * Queues a composite packet in the egress queue of its rendition (GSO mode). FEC packets go along with the frames they protect, so only video packets open and complete frames. A frame whose last packet is lost is sent once a packet of the next frame arrives, and a queue past its bounds is sent at once, so that a rendition never stalls on an incomplete frame.
+ */
+void rendition_egress_queue(room &r, rendition &rend, worker &w, const char *data, size_t len, gint64 current_time)
+{
+    if (len >= 12 && ((uint8_t)data[1] & 0x7f) != FEC_PAYLOAD_TYPE)
+    {
+        uint32_t timestamp;
+        memcpy(&timestamp, data + 4, 4);
+        timestamp = ntohl(timestamp);
+        if (rend.is_frame_open && timestamp != rend.frame_timestamp && !rend.egress_lens.empty())
+        {
+            room_fanout_frame(r, w, rend, current_time);
+        }
+        rend.frame_timestamp = timestamp;
+        // The marker bit is set on the last packet of a frame
+        rend.is_frame_open = !((uint8_t)data[1] & 0x80);
+    }
+    rend.egress_data.insert(rend.egress_data.end(), data, data + len);
+    rend.egress_lens.push_back(len);
+    if (rend.egress_lens.size() >= EGRESS_QUEUE_MAX_PACKETS || rend.egress_data.size() >= EGRESS_QUEUE_MAX_BYTES)
+    {
+        room_fanout_frame(r, w, rend, current_time);
+    }
+    if (!rend.is_egress_pending)
+    {
+        rend.is_egress_pending = true;
+        w.egress_renditions.push_back(&rend);
+    }
+}
+
+/**
+ * Sends the fan-out messages of a receive batch. In GSO mode, the egress queues of the renditions that are not amid a frame are turned into messages first.
+ */
+void worker_fanout_send(worker &w, gint64 current_time)
+{
+    if (is_gso)
+    {
+        size_t pending_count = 0;
+        for (auto rend : w.egress_renditions)
+        {
+            if (rend->is_frame_open)
+            {
+                w.egress_renditions[pending_count++] = rend;
+                continue;
+            }
+            rend->is_egress_pending = false;
+            room_fanout_frame(*rend->owner, w, *rend, current_time);
+        }
+        w.egress_renditions.resize(pending_count);
+    }
+
+    if (is_gso || pacing_multiple > 0)
+    {
+        send_msgs_control(w.fanout_msgs, w.fanout_control_bufs, w.fanout_controls);
+    }
+
+    if (!w.fanout_msgs.empty())
+    {
+        send_msgs_send(server_sock, w.fanout_msgs, w.fanout_iovecs);
+    }
+
+    w.egress_frames.clear();
+    w.fanout_controls.clear();
+}
+
+/**
+ * Sends the packets held by the pacer of a worker whose slots are due.
+ */
+void worker_pacer_release(worker &w, gint64 current_time)
+{
+    auto &p = w.egress_pacer;
+    if (p.packet_count == 0)
+    {
+        p.time = current_time - current_time % PACER_SLOT_DURATION;
+        return;
+    }
+
+    w.fanout_msgs.clear();
+    w.fanout_iovecs.clear();
+    w.fanout_controls.clear();
+    gint64 release_start = p.time;
+    while (p.time <= current_time && p.packet_count > 0)
+    {
+        auto &slot = p.slots[(p.time / PACER_SLOT_DURATION) % PACER_SLOT_COUNT];
+        for (const auto &packet : slot.packets)
+        {
+            send_msgs_add(w.fanout_msgs, w.fanout_iovecs, slot.data.data() + packet.offset, packet.len, &packet.sockaddr);
+            w.fanout_controls.push_back({packet.segment_size, 0});
+        }
+        p.packet_count -= slot.packets.size();
+        p.time += PACER_SLOT_DURATION;
+    }
+
+    if (!w.fanout_msgs.empty())
+    {
+        send_msgs_control(w.fanout_msgs, w.fanout_control_bufs, w.fanout_controls);
+        send_msgs_send(server_sock, w.fanout_msgs, w.fanout_iovecs);
+    }
+    w.fanout_controls.clear();
+
+    for (gint64 slot_time = release_start; slot_time < p.time; slot_time += PACER_SLOT_DURATION)
+    {
+        auto &slot = p.slots[(slot_time / PACER_SLOT_DURATION) % PACER_SLOT_COUNT];
+        slot.packets.clear();
+        slot.data.clear();
+    }
+}
+
+/**
+ * Drops a room being closed from the renditions with queued composite packets.
+ */
+void worker_egress_forget(worker &w, room &r)
+{
+    for (auto &rend : r.renditions)
+    {
+        auto egress_it = std::find(w.egress_renditions.begin(), w.egress_renditions.end(), rend.get());
+        if (egress_it != w.egress_renditions.end())
+        {
+            w.egress_renditions.erase(egress_it);
+        }
+    }
+}
+
+/**
+ * Caches a composite packet of a rendition for retransmission, measures its latency and adds it to the messages to the sink clients of the rendition, or, in GSO mode, to the egress queue of the rendition.
+ */
+void room_relay_packet(room &r, worker &w, size_t rendition_ix, char *data, size_t len, gint64 current_time)
+{
+    auto &rend = *r.renditions[rendition_ix];
+    rendition_cache(rend, data, len);
+    if (is_latency_measured)
+    {
+        rendition_latency_measure(rend, data, len, current_time);
+    }
+    if (is_gso)
+    {
+        rendition_egress_queue(r, rend, w, data, len, current_time);
+        return;
+    }
+    room_fanout(r, w, rendition_ix, data, len, current_time);
+}
+
+/**
+ * Relays composite packets of a rendition from the GStreamer pipeline of a room (its udpsink_sock or, in in-process mode, its appsink) to its sink clients.
+ */
+void room_relay_composite(room &r, worker &w, size_t rendition_ix, gint64 current_time)
+{
+    auto &rend = *r.renditions[rendition_ix];
+
+    w.fanout_msgs.clear();
+    w.fanout_iovecs.clear();
+
+    if (is_in_process)
+    {
+        // Take all composite packets queued by the appsink
+        uint64_t count;
+        if (read(rend.appsink_eventfd, &count, sizeof(count)) < 0)
+        {
+            std::cerr << "Failed to read appsink_eventfd." << std::endl;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(rend.appsink_buffers_mutex);
+            std::swap(w.composite_buffers, rend.appsink_buffers);
+        }
+        stats.recv_calls++;
+        stats.recv_packets += w.composite_buffers.size();
+
+        w.composite_maps.resize(w.composite_buffers.size());
+        for (size_t i = 0; i < w.composite_buffers.size(); i++)
+        {
+            auto &map = w.composite_maps[i];
+            gst_buffer_map(w.composite_buffers[i], &map, GST_MAP_READ);
+            room_relay_packet(r, w, rendition_ix, (char *)map.data, map.size, current_time);
+        }
+        worker_fanout_send(w, current_time);
+
+        for (size_t i = 0; i < w.composite_buffers.size(); i++)
+        {
+            gst_buffer_unmap(w.composite_buffers[i], &w.composite_maps[i]);
+            gst_buffer_unref(w.composite_buffers[i]);
+        }
+        w.composite_buffers.clear();
+        return;
+    }
+
+    // Receive from GStreamer
+    auto &batch = *w.composite_batch;
+    int msg_count = is_batched ? recv_batch_recv(rend.udpsink_sock, batch) : recv_batch_recv_one(rend.udpsink_sock, batch);
+    if (msg_count < 0)
+    {
+        std::cerr << "Failed to receive from GStreamer." << std::endl;
+        return;
+    }
+
+    // Send received data from GStreamer to all active clients of the rendition
+    for (int i = 0; i < msg_count; i++)
+    {
+        room_relay_packet(r, w, rendition_ix, batch.buffers[i], batch.msgs[i].msg_len, current_time);
+    }
+    worker_fanout_send(w, current_time);
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * Relays the composite packets received by the multishot receives on the udpsink_sock of the renditions of a worker (io_uring backend). Receives that ended are armed again, and the renditions of closed rooms are released once their receives have ended.
+ */
+void worker_relay_uring(worker &w, gint64 current_time)
+{
+    w.fanout_msgs.clear();
+    w.fanout_iovecs.clear();
+    w.uring_recvs_ended.clear();
+
+    unsigned head;
+    unsigned cqe_count = 0;
+    uint64_t packet_count = 0;
+    io_uring_cqe *cqe;
+    io_uring_for_each_cqe(&uring->recv_ring, head, cqe)
+    {
+        cqe_count++;
+        auto rend = (rendition *)io_uring_cqe_get_data(cqe);
+        char *data;
+        size_t len;
+        sockaddr_in *sockaddr;
+        if (uring_recv_parse(*uring, cqe, data, len, sockaddr) && rend && rend->owner)
+        {
+            room_relay_packet(*rend->owner, w, rend->rendition_ix, data, len, current_time);
+            packet_count++;
+        }
+        if (rend && !(cqe->flags & IORING_CQE_F_MORE))
+        {
+            w.uring_recvs_ended.push_back({rend, uring_recv_is_rearm_needed(cqe)});
+        }
+    }
+    io_uring_cq_advance(&uring->recv_ring, cqe_count);
+
+    if (packet_count > 0)
+    {
+        stats.recv_calls++;
+        stats.recv_packets += packet_count;
+    }
+
+    worker_fanout_send(w, current_time);
+
+    // The composite packets have been sent, so their buffers can be reused
+    uring_buffers_recycle(*uring);
+
+    for (auto &[rend, is_rearm_needed] : w.uring_recvs_ended)
+    {
+        if (rend->owner == nullptr)
+        {
+            close(rend->udpsink_sock);
+            auto closing_it = std::find_if(w.renditions_closing.begin(), w.renditions_closing.end(), [rend = rend](const std::unique_ptr<rendition> &closing)
+                                           { return closing.get() == rend; });
+            if (closing_it != w.renditions_closing.end())
+            {
+                w.renditions_closing.erase(closing_it);
+            }
+        }
+        else if (is_rearm_needed)
+        {
+            uring_recv_arm(*uring, rend->udpsink_sock, rend);
+        }
+        else
+        {
+            std::cerr << "Failed to receive from GStreamer." << std::endl;
+            rend->is_uring_armed = false;
+        }
+    }
+}
+
+/**
+ * Cancels the multishot receives of the renditions of a room about to be closed (io_uring backend). The worker keeps the renditions whose receives are armed, with their udpsink_sock, until the last completion of their receives.
+ */
+void room_cancel_uring(room &r, worker &w)
+{
+    for (auto &rend : r.renditions)
+    {
+        rend->owner = nullptr;
+        if (rend->is_uring_armed)
+        {
+            uring_recv_cancel(*uring, rend->udpsink_sock);
+            w.renditions_closing.push_back(std::move(rend));
+        }
+    }
+    r.renditions.erase(std::remove(r.renditions.begin(), r.renditions.end(), nullptr), r.renditions.end());
+}
+#endif
+
+/**
+ * Removes the clients of a room that have been inactive for a while, freeing their positions, and gives the freed source elements to hidden source clients.
+ */
+void room_check_activity(room &r, gint64 current_time, room_changes &changes)
+{
+    if (current_time - r.client_activity_check <= 8000000)
+        return;
+
+    r.client_activity_check = current_time;
+    gint64 sweep_start = metrics ? g_get_monotonic_time() : 0;
+
+    std::vector<sockaddr_in> client_sockaddrs_inactive;
+
+    for (const auto &client : r.clients.entries)
+    {
+        if (current_time - client.activity > 2000000)
+        {
+            client_sockaddrs_inactive.push_back(client.sockaddr);
+        }
+    }
+
+    for (const auto &client_sockaddr : client_sockaddrs_inactive)
+    {
+        auto client = r.clients.find(client_sockaddr);
+
+        if ((client->roles & CLIENT_ROLE_SOURCE) && is_sfu)
+        {
+            r.source_client_count--;
+
+            changes.has_source_removal_occurred = true;
+        }
+        else if (client->roles & CLIENT_ROLE_SOURCE)
+        {
+            size_t position = r.source_branches[client->src_ix]->position;
+            source_branch_destroy(r, client->src_ix);
+            source_position_release(r, position);
+
+            r.source_client_count--;
+
+            changes.has_source_removal_occurred = true;
+        }
+        else if (client->roles & CLIENT_ROLE_HIDDEN_SOURCE)
+        {
+            r.hidden_sources.erase(std::find_if(r.hidden_sources.begin(), r.hidden_sources.end(), [&](const sockaddr_in &hidden_sockaddr)
+                                                { return hidden_sockaddr.sin_addr.s_addr == client_sockaddr.sin_addr.s_addr && hidden_sockaddr.sin_port == client_sockaddr.sin_port; }));
+        }
+
+        r.clients.erase(client_sockaddr);
+
+        changes.has_removal_occurred = true;
+    }
+
+    // Hidden source clients become visible in order of arrival, and their video data is routed from their next keyframe on
+    size_t hidden_source_ix = 0;
+    int src_ix;
+    while (hidden_source_ix < r.hidden_sources.size() && (src_ix = source_branch_create(r)) != -1)
+    {
+        auto client = r.clients.find(r.hidden_sources[hidden_source_ix++]);
+        client->roles &= ~CLIENT_ROLE_HIDDEN_SOURCE;
+        source_client_place(r, *client, src_ix);
+
+        changes.has_source_addition_occurred = true;
+    }
+    r.hidden_sources.erase(r.hidden_sources.begin(), r.hidden_sources.begin() + hidden_source_ix);
+
+    if (metrics)
+    {
+        histogram_observe(metrics->sweep_duration, g_get_monotonic_time() - sweep_start);
+    }
+}
+
+bool client_is_congested(const client_entry &client)
+{
+    return client.report.loss_permille > CONGESTION_LOSS_PERMILLE || client.report.jitter_ms > CONGESTION_JITTER_MS;
+}
+
+/**
+ * Adapts to the receiver reports of the sink clients of a room, once per second. Each rendition bitrate is decreased multiplicatively when any of its sink clients is congested and increased additively, up to the configured bitrate, when none is. Then, congested sink clients move to the next lower rendition, and sink clients uncongested for a while move back up, so that queues do not build up on slow links.
+ */
+void room_adapt(room &r, gint64 current_time)
+{
+    if (current_time - r.adaptation_check <= 1000000)
+        return;
+
+    gint64 previous_check = r.adaptation_check;
+    r.adaptation_check = current_time;
+
+    // Only reports received since the previous check are acted on, so that each report cuts the bitrate or moves its client at most once
+    auto is_report_fresh = [&](const client_entry &client)
+    {
+        return (client.roles & CLIENT_ROLE_SINK) && client.report_time > previous_check;
+    };
+
+    for (size_t k = 0; k < r.renditions.size(); k++)
+    {
+        auto &rend = *r.renditions[k];
+        bool has_report = false;
+        bool is_congested = false;
+        for (const auto &client : r.clients.entries)
+        {
+            if (client.rendition != k || !is_report_fresh(client))
+                continue;
+            has_report = true;
+            is_congested = is_congested || client_is_congested(client);
+        }
+        if (!has_report)
+            continue;
+
+        int bitrate = is_congested ? std::max(rend.max_bitrate / 4, rend.bitrate * 85 / 100) : std::min(rend.max_bitrate, rend.bitrate + rend.max_bitrate / 20);
+        if (bitrate != rend.bitrate)
+        {
+            rend.bitrate = bitrate;
+            g_object_set(rend.x264enc, "bitrate", bitrate, nullptr);
+        }
+    }
+
+    for (auto &client : r.clients.entries)
+    {
+        if (!is_report_fresh(client))
+            continue;
+
+        if (client_is_congested(client))
+        {
+            client.uncongested_check_count = 0;
+            if (client.rendition + 1u < r.renditions.size())
+            {
+                client.rendition++;
+                r.renditions[client.rendition]->is_keyframe_needed = true;
+            }
+        }
+        // Moving up takes longer than moving down, so that clients do not oscillate between renditions
+        else if (++client.uncongested_check_count >= 10)
+        {
+            client.uncongested_check_count = 0;
+            if (client.rendition > client.rendition_min)
+            {
+                client.rendition--;
+                r.renditions[client.rendition]->is_keyframe_needed = true;
+            }
+        }
+    }
+}
+
+/**
+ * Asks the source clients whose video is dropped until a keyframe for one again, every KEYFRAME_REQUEST_INTERVAL, in case the previous request was lost.
+ */
+void room_request_keyframes(room &r, gint64 current_time)
+{
+    if (current_time - r.keyframe_check <= KEYFRAME_REQUEST_INTERVAL)
+        return;
+
+    r.keyframe_check = current_time;
+
+    for (const auto &client : r.clients.entries)
+    {
+        if ((client.roles & CLIENT_ROLE_SOURCE) && client.is_keyframe_awaited)
+        {
+            client_keyframe_request(client.sockaddr);
+        }
+    }
+}
+
+/**
+ * Sizes the playout delay of each source client sub-pipeline after its jitter, once per second.
+ */
+void room_adapt_jitterbuffers(room &r, gint64 current_time)
+{
+    if (current_time - r.jitterbuffer_check <= 1000000)
+        return;
+
+    r.jitterbuffer_check = current_time;
+
+    for (auto branch : r.source_branches)
+    {
+        if (branch)
+        {
+            jitterbuffer_adapt(branch->rtpjitterbuffer, video_config.framerate);
+        }
+    }
+}
+
+/**
+ * Applies the changes to the clients of a room to its composite output.
+ */
+void room_update(room &r, const room_changes &changes, gint64 current_time)
+{
+    // Sink clients that started receiving a rendition get a keyframe right away, instead of waiting for the next one
+    for (auto &rend : r.renditions)
+    {
+        if (rend->is_keyframe_needed)
+        {
+            rendition_keyframe_request(*rend);
+            rend->is_keyframe_needed = false;
+        }
+    }
+
+    // In SFU mode, joining sink clients get keyframes from all source clients
+    if (is_sfu && changes.has_addition_occurred)
+    {
+        for (const auto &client : r.clients.entries)
+        {
+            if (client.roles & CLIENT_ROLE_SOURCE)
+            {
+                client_keyframe_request(client.sockaddr);
+            }
+        }
+    }
+
+    // Composite caps only change along with the grid, since new caps restart the encoders, and never with a fixed output size
+    bool is_cell_changed = false;
+    if (!is_sfu && room_grid_update(r, current_time))
+    {
+        is_cell_changed = room_cells_fit(r);
+        if (!is_fixed_output)
+        {
+            crop_videobox(r);
+            for (const auto &rend : r.renditions)
+            {
+                scale_rendition(r, *rend);
+            }
+        }
+    }
+
+    // Sources encode at the cell size, which joining sources do not know yet, and the others have to follow when it changes
+    if (!is_sfu && (changes.has_source_addition_occurred || is_cell_changed))
+    {
+        for (const auto &client : r.clients.entries)
+        {
+            if (client.roles & CLIENT_ROLE_SOURCE)
+            {
+                client_cell_send(r, client.sockaddr);
+            }
+        }
+    }
+
+    if (changes.has_addition_occurred || changes.has_removal_occurred)
+    {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "---- Active clients (room \"" << r.name << "\") ----" << std::endl;
+        for (const auto &client : r.clients.entries)
+        {
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(client.sockaddr.sin_addr), client_ip, INET_ADDRSTRLEN);
+            std::cout << client_ip << ":" << ntohs(client.sockaddr.sin_port) << ((client.roles & CLIENT_ROLE_HIDDEN_SOURCE) ? " (hidden)" : "") << std::endl;
+        }
+        std::cout << "------------------------" << std::endl;
+    }
+}
+
+/**
+ * Takes the rooms handed over by the router, opening added rooms and closing removed ones.
+ */
+void worker_take_rooms(worker &w)
+{
+    uint64_t count;
+    if (read(w.rooms_eventfd, &count, sizeof(count)) < 0)
+    {
+        std::cerr << "Failed to read rooms_eventfd." << std::endl;
+        return;
+    }
+
+    std::vector<std::shared_ptr<room>> rooms_added;
+    std::vector<std::shared_ptr<room>> rooms_removed;
+    {
+        std::lock_guard<std::mutex> lock(w.rooms_mutex);
+        std::swap(rooms_added, w.rooms_added);
+        std::swap(rooms_removed, w.rooms_removed);
+    }
+
+    for (auto &r : rooms_added)
+    {
+        if (!room_open(*r))
+        {
+            std::cerr << "Failed to open room \"" << r->name << "\"." << std::endl;
+            room_close(*r);
+            continue;
+        }
+        w.rooms.push_back(r);
+
+#ifdef HAVE_LIBURING
+        if (uring && !is_in_process)
+        {
+            for (auto &rend : r->renditions)
+            {
+                uring_recv_arm(*uring, rend->udpsink_sock, rend.get());
+                rend->is_uring_armed = true;
+            }
+        }
+#endif
+    }
+
+    for (auto &r : rooms_removed)
+    {
+        auto room_it = std::find(w.rooms.begin(), w.rooms.end(), r);
+        if (room_it != w.rooms.end())
+        {
+            w.rooms.erase(room_it);
+            worker_egress_forget(w, *r);
+#ifdef HAVE_LIBURING
+            if (uring)
+            {
+                room_cancel_uring(*r, w);
+            }
+#endif
+            room_close(*r);
+        }
+    }
+}
+
+/**
+ * Publishes a snapshot of the client counters of the rooms of a worker, which the metrics endpoint reads from its own thread.
+ */
+void worker_client_metrics_publish(worker &w)
+{
+    std::vector<client_metrics> snapshot;
+    for (const auto &r : w.rooms)
+    {
+        for (const auto &client : r->clients.entries)
+        {
+            bool has_report = client.report_time > 0;
+            snapshot.push_back({r->name, client.sockaddr, client.roles, client.recv_packets, client.recv_bytes, client.send_packets, client.send_bytes, has_report, client.report});
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(w.client_metrics_mutex);
+    std::swap(w.client_metrics_snapshot, snapshot);
+}
+
+/**
+ * Worker thread relay loop: waits for packets routed to its rooms and for composite packets of its rooms.
+ */
+void worker_run(worker &w)
+{
+    std::string thread_name = "worker " + std::to_string(w.ix);
+
+    std::vector<pollfd> fds;
+    // Index of the first poll set entry of each room
+    std::vector<size_t> room_fds_ixs;
+    bool are_fds_stale = true;
+
+    gint64 current_time = g_get_monotonic_time();
+    gint64 stats_check = current_time;
+    gint64 client_metrics_check = current_time;
+
+    thread_metrics_register(thread_name);
+
+#ifdef HAVE_LIBURING
+    if (is_uring && !uring_thread_init())
+        return;
+#endif
+
+    while (true)
+    {
+        // Poll set: rooms_eventfd, then, per room, inbox_eventfd and udpsink_sock (or appsink_eventfd) per rendition, then, with the io_uring backend, the receive ring, which receives from all udpsink_socks instead
+        if (are_fds_stale)
+        {
+            fds.clear();
+            room_fds_ixs.clear();
+            fds.push_back({w.rooms_eventfd, POLLIN, 0});
+            for (const auto &r : w.rooms)
+            {
+                room_fds_ixs.push_back(fds.size());
+                fds.push_back({r->inbox_eventfd, POLLIN, 0});
+                for (const auto &rend : r->renditions)
+                {
+                    // Negative file descriptors are ignored by poll
+                    fds.push_back({is_in_process ? rend->appsink_eventfd : (is_uring ? -1 : rend->udpsink_sock), POLLIN, 0});
+                }
+            }
+#ifdef HAVE_LIBURING
+            if (uring)
+            {
+                fds.push_back({uring->recv_ring.ring_fd, POLLIN, 0});
+            }
+#endif
+            are_fds_stale = false;
+        }
+
+        // Block until an event occurs, waking up periodically for the client activity checks, and for the pacer when it holds packets
+        int poll_res = poll(fds.data(), fds.size(), pacer_timeout(w.egress_pacer, current_time, 1000));
+        if (poll_res == -1)
+        {
+            std::cerr << "Poll error." << std::endl;
+            return;
+        }
+
+        current_time = g_get_monotonic_time();
+
+        if (pacing_multiple > 0 && !is_txtime)
+        {
+            worker_pacer_release(w, current_time);
+        }
+
+        for (size_t i = 0; i < w.rooms.size(); i++)
+        {
+            auto &r = *w.rooms[i];
+            auto room_fds = fds.data() + room_fds_ixs[i];
+            room_changes changes;
+
+            // Check whether inbox_eventfd has data
+            if (room_fds[0].revents & POLLIN)
+            {
+                room_route_inbox(r, w, current_time, changes);
+            }
+
+            // Check whether udpsink_sock (or appsink_eventfd, in in-process mode) of each rendition has data
+            for (size_t k = 0; k < r.renditions.size(); k++)
+            {
+                if (room_fds[1 + k].revents & POLLIN)
+                {
+                    gint64 fanout_start = metrics ? g_get_monotonic_time() : 0;
+                    room_relay_composite(r, w, k, current_time);
+                    if (metrics)
+                    {
+                        histogram_observe(metrics->fanout_duration, g_get_monotonic_time() - fanout_start);
+                    }
+                }
+            }
+
+            room_check_activity(r, current_time, changes);
+
+            if (!is_sfu)
+            {
+                room_request_keyframes(r, current_time);
+            }
+
+            if (is_adaptive && !is_sfu)
+            {
+                room_adapt(r, current_time);
+            }
+
+            if (source_jitterbuffer_mode == jitterbuffer_mode::adaptive)
+            {
+                room_adapt_jitterbuffers(r, current_time);
+            }
+
+            room_update(r, changes, current_time);
+        }
+
+#ifdef HAVE_LIBURING
+        // Check whether the receive ring has completions
+        if (uring && (fds.back().revents & POLLIN))
+        {
+            gint64 fanout_start = metrics ? g_get_monotonic_time() : 0;
+            worker_relay_uring(w, current_time);
+            if (metrics)
+            {
+                histogram_observe(metrics->fanout_duration, g_get_monotonic_time() - fanout_start);
+            }
+        }
+#endif
+
+        // Rooms are taken last, since the poll set no longer matches the rooms afterwards
+        if (fds[0].revents & POLLIN)
+        {
+            worker_take_rooms(w);
+            are_fds_stale = true;
+        }
+
+        if (current_time - stats_check > 8000000)
+        {
+            stats_check = current_time;
+            print_relay_stats(thread_name);
+            for (const auto &r : w.rooms)
+            {
+                if (is_latency_measured)
+                {
+                    print_room_latency(*r);
+                }
+            }
+        }
+
+        if (metrics)
+        {
+            histogram_observe(metrics->loop_duration, g_get_monotonic_time() - current_time);
+            if (current_time - client_metrics_check > 1000000)
+            {
+                client_metrics_check = current_time;
+                worker_client_metrics_publish(w);
+            }
+        }
+    }
+}
+
+/**
+ * Starts a worker thread, pinned to a core.
+ */
+void worker_start(worker &w, size_t core_count)
+{
+    w.rooms_eventfd = eventfd(0, 0);
+    w.thread = std::thread(worker_run, std::ref(w));
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(w.ix % core_count, &cpuset);
+    if (pthread_setaffinity_np(w.thread.native_handle(), sizeof(cpuset), &cpuset) != 0)
+    {
+        std::cerr << "Failed to pin worker " << w.ix << " to a core." << std::endl;
+    }
+    // Workers run for the lifetime of the process
+    w.thread.detach();
+}
+
+/**
+ * Route from a client to the room it has joined. Owned by the router thread of the shard receiving the client packets.
+ */
+struct route_entry
+{
+    sockaddr_in sockaddr;
+    // Last activity time
+    gint64 activity;
+    std::shared_ptr<room> joined_room;
+};
+
+/**
+ * Rooms by name and the workers running them, shared by the router threads.
+ */
+struct room_directory
+{
+    std::map<std::string, std::shared_ptr<room>> rooms;
+    std::vector<std::unique_ptr<worker>> workers;
+    // Room count per worker
+    std::vector<size_t> worker_room_counts;
+    // Guards rooms, worker_room_counts and the route counts of the rooms
+    std::mutex mutex;
+};
 
-                    auto udpsrc_sockaddr = udpsrc_sockaddrs_available.back();
-                    client_routes[client_sockaddr] = udpsrc_sockaddr;
+room_directory directory;
 
-                    auto udpsrc_ix = udpsrc_ixs[udpsrc_sockaddr];
-                    auto pad = compositor_pads[udpsrc_ix];
+/**
+ * Router thread state. Each shard has its own socket bound to the server port, with SO_REUSEPORT, and the kernel hashes each client to one shard, so route tables are partitioned by shard and not shared.
+ */
+struct shard
+{
+    size_t ix;
+    int sock;
+    std::thread thread;
+    sockaddr_table<route_entry> routes;
+    std::unique_ptr<recv_batch> client_batch = std::make_unique<recv_batch>();
+};
 
-                    auto position = positions_available.back();
-                    udpsrc_positions[udpsrc_sockaddr] = position;
+/**
+ * Adds a route to the room with the given name, creating the room on the least loaded worker if it does not exist.
+ */
+std::shared_ptr<room> directory_room_join(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(directory.mutex);
 
-                    auto position_cell = position_cells[position];
-                    rows = std::max(rows, (uint8_t)(position_cell.first + 1));
-                    cols = std::max(cols, (uint8_t)(position_cell.second + 1));
+    if (auto room_it = directory.rooms.find(name); room_it != directory.rooms.end())
+    {
+        room_it->second->route_count++;
+        return room_it->second;
+    }
 
-                    auto position_point = position_points[position];
+    auto r = std::make_shared<room>();
+    r->name = name;
+    r->inbox_eventfd = eventfd(0, 0);
+    r->route_count = 1;
+    auto &counts = directory.worker_room_counts;
+    r->worker_ix = std::min_element(counts.begin(), counts.end()) - counts.begin();
+    counts[r->worker_ix]++;
+    directory.rooms[name] = r;
+
+    auto &w = *directory.workers[r->worker_ix];
+    queue_push(w.rooms_mutex, w.rooms_eventfd, [&]()
+               {
+                   bool was_empty = w.rooms_added.empty() && w.rooms_removed.empty();
+                   w.rooms_added.push_back(r);
+                   return was_empty; });
+    return r;
+}
 
-                    g_object_set(pad, "alpha", 1.0, "xpos", position_point.first, "ypos", position_point.second, "width", 320, "height", 240, nullptr);
+/**
+ * Removes routes from a room, closing the room when no routes remain. Since routes are only added under the directory mutex, a closed room never gets new routes.
+ */
+void directory_room_leave(const std::shared_ptr<room> &r, size_t route_count)
+{
+    std::lock_guard<std::mutex> lock(directory.mutex);
 
-                    positions_available.pop_back();
-                    udpsrc_sockaddrs_available.pop_back();
+    r->route_count -= route_count;
+    if (r->route_count > 0)
+        return;
 
-                    has_source_addition_occurred = true;
-                }
+    directory.rooms.erase(r->name);
+    directory.worker_room_counts[r->worker_ix]--;
 
-                sink_client_sockaddrs.insert(client_sockaddr);
+    auto &w = *directory.workers[r->worker_ix];
+    queue_push(w.rooms_mutex, w.rooms_eventfd, [&]()
+               {
+                   bool was_empty = w.rooms_added.empty() && w.rooms_removed.empty();
+                   w.rooms_removed.push_back(r);
+                   return was_empty; });
+}
 
-                has_addition_occurred = true;
-            }
+/**
+ * Routes a client packet to the inbox of the room the client has joined. Clients that have not sent a join message are routed to the default room, named "".
+ */
+void shard_route(shard &s, const sockaddr_in &client_sockaddr, const char *data, size_t len, gint64 current_time)
+{
+    auto route = s.routes.find(client_sockaddr);
 
-            // If a client route exists, route to the associated udpsrc_sockaddr
-            if (auto client_route = client_routes.find(client_sockaddr); client_route != client_routes.end())
-            {
-                // TODO Check whether it is OK to use server_sock to send
-                if (sendto(server_sock, buffer, bytes_read, 0, (struct sockaddr *)&(client_route->second), sizeof(client_route->second)) < 0)
-                {
-                    std::cerr << "Failed to send to GStreamer." << std::endl;
-                    continue;
-                }
-            }
+    bool is_join = control_message_is(data, len) && control_message_type(data) == CONTROL_JOIN;
+    if (route == nullptr || (is_join && route->joined_room->name != control_join_room_name(data, len)))
+    {
+        auto r = directory_room_join(is_join ? control_join_room_name(data, len) : "");
+        if (route == nullptr)
+        {
+            route = &s.routes.insert(client_sockaddr);
+        }
+        else
+        {
+            // The client leaves its previous room, where it times out
+            directory_room_leave(route->joined_room, 1);
+        }
+        route->joined_room = r;
+    }
+
+    route->activity = current_time;
+
+    auto &r = *route->joined_room;
+    queue_push(r.inbox_mutex, r.inbox_eventfd, [&]()
+               {
+                   bool was_empty = r.inbox_packets.empty();
+                   r.inbox_packets.push_back({client_sockaddr, r.inbox_data.size(), len});
+                   r.inbox_data.insert(r.inbox_data.end(), data, data + len);
+                   return was_empty; });
+}
+
+/**
+ * Removes inactive routes, closing rooms left without routes.
+ */
+void shard_check_activity(shard &s, gint64 current_time)
+{
+    std::vector<sockaddr_in> client_sockaddrs_inactive;
+
+    for (const auto &route : s.routes.entries)
+    {
+        if (current_time - route.activity > 2000000)
+        {
+            client_sockaddrs_inactive.push_back(route.sockaddr);
         }
+    }
+
+    for (const auto &client_sockaddr : client_sockaddrs_inactive)
+    {
+        directory_room_leave(s.routes.find(client_sockaddr)->joined_room, 1);
+        s.routes.erase(client_sockaddr);
+    }
+}
 
-        // Check whether udpsink_sock has data
-        if (fds[1].revents & POLLIN)
+/**
+ * Receives the pending client packets of the shard socket and routes them to rooms, adding their count and size to the given totals.
+ */
+void shard_recv_route(shard &s, gint64 current_time, uint64_t &packet_count, uint64_t &bytes)
+{
+#ifdef HAVE_LIBURING
+    if (uring)
+    {
+        unsigned head;
+        unsigned cqe_count = 0;
+        bool is_rearm_needed = false;
+        io_uring_cqe *cqe;
+        io_uring_for_each_cqe(&uring->recv_ring, head, cqe)
         {
-            // Receive from GStreamer
-            // TODO Check whether the same buffer and struct should be used for GStreamer
-            bytes_read = recvfrom(udpsink_sock, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_sockaddr, &client_sockaddr_len);
-            if (bytes_read < 0)
+            cqe_count++;
+            char *data;
+            size_t len;
+            sockaddr_in *sockaddr;
+            if (uring_recv_parse(*uring, cqe, data, len, sockaddr))
             {
-                std::cerr << "Failed to receive from GStreamer." << std::endl;
-                continue;
+                shard_route(s, *sockaddr, data, len, current_time);
+                packet_count++;
+                bytes += len;
             }
+            is_rearm_needed = is_rearm_needed || uring_recv_is_rearm_needed(cqe);
+        }
+        io_uring_cq_advance(&uring->recv_ring, cqe_count);
+
+        // Routing copies the packets into the room inboxes, so their buffers can be reused right away
+        uring_buffers_recycle(*uring);
+        if (is_rearm_needed)
+        {
+            uring_recv_arm(*uring, s.sock, &s);
+        }
+
+        if (packet_count > 0)
+        {
+            stats.recv_calls++;
+            stats.recv_packets += packet_count;
+        }
+        return;
+    }
+#endif
+
+    // Receive from clients
+    auto &client_batch = *s.client_batch;
+    int msg_count = is_batched ? recv_batch_recv(s.sock, client_batch) : recv_batch_recv_one(s.sock, client_batch);
+    if (msg_count < 0)
+    {
+        std::cerr << "Failed to receive from clients." << std::endl;
+        return;
+    }
+
+    for (int i = 0; i < msg_count; i++)
+    {
+        shard_route(s, client_batch.sockaddrs[i], client_batch.buffers[i], client_batch.msgs[i].msg_len, current_time);
+        packet_count++;
+        bytes += client_batch.msgs[i].msg_len;
+    }
+}
+
+/**
+ * Router thread loop: receives client packets on the shard socket and routes them to rooms.
+ */
+void shard_run(shard &s)
+{
+    std::string thread_name = "router " + std::to_string(s.ix);
+
+    struct pollfd fds[1];
+
+    fds[0].fd = s.sock;
+    fds[0].events = POLLIN;
+
+    recv_batch_init(*s.client_batch);
+
+    gint64 current_time = g_get_monotonic_time();
+    gint64 client_activity_check = current_time;
+
+    thread_metrics_register(thread_name);
+
+#ifdef HAVE_LIBURING
+    // With the io_uring backend, a multishot receive takes the datagrams of the shard socket, so its completions are polled instead
+    if (is_uring)
+    {
+        if (!uring_thread_init())
+            return;
+        uring_recv_arm(*uring, s.sock, &s);
+        fds[0].fd = uring->recv_ring.ring_fd;
+    }
+#endif
+
+    while (true)
+    {
+        // Block until a socket event occurs, waking up periodically for the client activity checks
+        int poll_res = poll(fds, 1, 1000);
+        if (poll_res == -1)
+        {
+            std::cerr << "Poll error." << std::endl;
+            return;
+        }
+
+        current_time = g_get_monotonic_time();
 
-            // Send received data from GStreamer to all active clients
-            for (const auto &client_sockaddr : sink_client_sockaddrs)
+        // Check whether the shard socket (or the receive ring) has data
+        if (fds[0].revents & POLLIN)
+        {
+            uint64_t packet_count = 0;
+            uint64_t bytes = 0;
+            shard_recv_route(s, current_time, packet_count, bytes);
+
+            if (metrics)
             {
-                if (sendto(server_sock, buffer, bytes_read, 0, (struct sockaddr *)&client_sockaddr, sizeof(client_sockaddr)) < 0)
-                {
-                    std::cerr << "Failed to send to client." << std::endl;
-                    continue;
-                }
+                counter_add(metrics->ingress_packets, packet_count);
+                counter_add(metrics->ingress_bytes, bytes);
+                histogram_observe(metrics->route_duration, g_get_monotonic_time() - current_time);
             }
         }
 
         if (current_time - client_activity_check > 8000000)
         {
             client_activity_check = current_time;
-            client_sockaddrs_inactive.clear();
-
-            for (const auto &client_sockaddr : client_sockaddrs)
+            gint64 sweep_start = metrics ? g_get_monotonic_time() : 0;
+            shard_check_activity(s, current_time);
+            if (metrics)
             {
-                if (current_time - client_activity[client_sockaddr] > 2000000)
-                {
-                    client_sockaddrs_inactive.push_back(client_sockaddr);
-                }
+                histogram_observe(metrics->sweep_duration, g_get_monotonic_time() - sweep_start);
             }
+            print_relay_stats(thread_name);
+        }
+    }
+}
 
-            for (const auto &client_sockaddr : client_sockaddrs_inactive)
-            {
-                if (source_client_sockaddrs.count(client_sockaddr) == 1)
-                {
-                    auto udpsrc_sockaddr = client_routes[client_sockaddr];
-                    auto udpsrc_ix = udpsrc_ixs[udpsrc_sockaddr];
-                    auto pad = compositor_pads[udpsrc_ix];
+/**
+ * Creates a socket bound to the server port. With more than one shard, SO_REUSEPORT is set, so that the kernel spreads clients across the shard sockets. Returns the socket, or -1 on error.
+ */
+int shard_sock_make(int server_port, bool is_sharded)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        std::cerr << "Failed to create server socket." << std::endl;
+        return -1;
+    }
 
-                    g_object_set(pad, "alpha", 0.0, "xpos", 0, "ypos", 0, "width", 0, "height", 0, nullptr);
+    int reuseport = 1;
+    if (is_sharded && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) < 0)
+    {
+        std::cerr << "Failed to set SO_REUSEPORT on server socket." << std::endl;
+        close(sock);
+        return -1;
+    }
 
-                    auto udpsrc_position = udpsrc_positions[udpsrc_sockaddr];
+    sockaddr_in server_sockaddr{};
+    server_sockaddr.sin_family = AF_INET;
+    inet_pton(AF_INET, "0.0.0.0", &(server_sockaddr.sin_addr));
+    server_sockaddr.sin_port = htons(server_port);
 
-                    positions_available.push_back(udpsrc_position);
-                    udpsrc_sockaddrs_available.push_back(udpsrc_sockaddr);
+    if (bind(sock, (struct sockaddr *)&server_sockaddr, sizeof(server_sockaddr)) < 0)
+    {
+        std::cerr << "Failed to bind server socket." << std::endl;
+        close(sock);
+        return -1;
+    }
 
-                    udpsrc_positions.erase(udpsrc_sockaddr);
-                    source_client_sockaddrs.erase(client_sockaddr);
-                    client_routes.erase(client_sockaddr);
+    return sock;
+}
 
-                    has_source_removal_occurred = true;
-                }
+/**
+ * Parses a comma-separated list of renditions, each one given as bitrate[@scale], e.g. 1500,500@0.5,150@0.25.
+ */
+bool parse_renditions(const std::string &renditions_arg, std::vector<rendition_spec> &specs)
+{
+    specs.clear();
+    size_t start = 0;
+    while (start <= renditions_arg.size())
+    {
+        size_t end = renditions_arg.find(',', start);
+        if (end == std::string::npos)
+            end = renditions_arg.size();
+        std::string item = renditions_arg.substr(start, end - start);
+
+        rendition_spec spec{0, 1.0};
+        size_t at = item.find('@');
+        spec.bitrate = atoi(item.substr(0, at).c_str());
+        if (at != std::string::npos)
+            spec.scale = atof(item.substr(at + 1).c_str());
+        if (spec.bitrate <= 0 || spec.scale <= 0 || spec.scale > 1)
+            return false;
+        specs.push_back(spec);
+
+        start = end + 1;
+    }
+    // Rendition indices are sent in a single byte
+    return !specs.empty() && specs.size() <= 256;
+}
 
-                if (sink_client_sockaddrs.count(client_sockaddr) == 1)
-                {
-                    sink_client_sockaddrs.erase(client_sockaddr);
-                }
+/**
+ * Parses a size argument of the form WxH, with even dimensions as required by x264enc.
+ */
+bool parse_size(const char *size_arg, uint16_t &width, uint16_t &height)
+{
+    unsigned parsed_width;
+    unsigned parsed_height;
+    char end;
+    if (sscanf(size_arg, "%ux%u%c", &parsed_width, &parsed_height, &end) != 2 || parsed_width < 2 || parsed_height < 2 || parsed_width > 8192 || parsed_height > 8192 || parsed_width % 2 || parsed_height % 2)
+        return false;
+    width = parsed_width;
+    height = parsed_height;
+    return true;
+}
 
-                client_sockaddrs.erase(client_sockaddr);
-                client_activity.erase(client_sockaddr);
+/**
+ * Parses a count argument, which must be a whole positive integer.
+ */
+bool parse_count(const char *count_arg, size_t &count)
+{
+    char *end;
+    long parsed_count = strtol(count_arg, &end, 10);
+    if (*count_arg == '\0' || *end != '\0' || parsed_count < 1)
+        return false;
+    count = parsed_count;
+    return true;
+}
+
+/**
+ * Renders the metrics of the relay threads and the clients, in the Prometheus text exposition format. Runs on the metrics endpoint thread.
+ */
+std::string metrics_render()
+{
+    std::string out;
 
-                has_removal_occurred = true;
+    {
+        std::lock_guard<std::mutex> lock(thread_metrics_mutex);
+
+        // Families of thread counters, each with one sample per thread
+        std::vector<std::tuple<std::string, std::string, std::atomic<uint64_t> thread_metrics::*>> counters = {
+            {"animatour_ingress_packets_total", "Client packets received by the router.", &thread_metrics::ingress_packets},
+            {"animatour_ingress_bytes_total", "Client bytes received by the router.", &thread_metrics::ingress_bytes},
+            {"animatour_route_packets_total", "Source client packets routed to composite pipelines.", &thread_metrics::route_packets},
+            {"animatour_egress_packets_total", "Packets sent to sink clients.", &thread_metrics::egress_packets},
+            {"animatour_egress_bytes_total", "Bytes sent to sink clients.", &thread_metrics::egress_bytes},
+        };
+        for (const auto &counter : counters)
+        {
+            metric_header_render(out, std::get<0>(counter), "counter", std::get<1>(counter));
+            for (const auto &m : thread_metrics_list)
+            {
+                metric_sample_render(out, std::get<0>(counter), "thread=\"" + m->thread_name + "\"", ((*m).*std::get<2>(counter)).load(std::memory_order_relaxed));
             }
+        }
 
-            if (has_source_removal_occurred)
+        std::vector<std::tuple<std::string, std::string, histogram thread_metrics::*>> histograms = {
+            {"animatour_route_duration_seconds", "Duration of routing a batch of received client packets.", &thread_metrics::route_duration},
+            {"animatour_fanout_duration_seconds", "Duration of relaying composite packets to sink clients.", &thread_metrics::fanout_duration},
+            {"animatour_sweep_duration_seconds", "Duration of the client inactivity sweeps.", &thread_metrics::sweep_duration},
+            {"animatour_loop_duration_seconds", "Busy duration of the worker relay loop iterations.", &thread_metrics::loop_duration},
+        };
+        for (const auto &h : histograms)
+        {
+            metric_header_render(out, std::get<0>(h), "histogram", std::get<1>(h));
+            for (const auto &m : thread_metrics_list)
             {
-                compact_positions();
+                histogram_render(out, std::get<0>(h), "thread=\"" + m->thread_name + "\"", (*m).*std::get<2>(h));
             }
         }
+    }
+
+    std::vector<client_metrics> clients;
+    for (const auto &w : directory.workers)
+    {
+        std::lock_guard<std::mutex> lock(w->client_metrics_mutex);
+        clients.insert(clients.end(), w->client_metrics_snapshot.begin(), w->client_metrics_snapshot.end());
+    }
+
+    std::vector<std::string> client_labels;
+    for (const auto &client : clients)
+    {
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(client.sockaddr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        std::string roles = (client.roles & CLIENT_ROLE_SOURCE) ? "source" : ((client.roles & CLIENT_ROLE_HIDDEN_SOURCE) ? "hidden_source" : "sink");
+        // Room names are chosen by clients, so quotes and backslashes are escaped
+        std::string room_name;
+        for (char c : client.room_name)
+        {
+            if (c == '"' || c == '\\')
+                room_name += '\\';
+            room_name += c == '\n' ? ' ' : c;
+        }
+        client_labels.push_back("room=\"" + room_name + "\",client=\"" + client_ip + ":" + std::to_string(ntohs(client.sockaddr.sin_port)) + "\",role=\"" + roles + "\"");
+    }
 
-        if (has_source_addition_occurred || has_source_removal_occurred)
+    std::vector<std::tuple<std::string, std::string, uint64_t client_metrics::*>> client_counters = {
+        {"animatour_client_received_packets_total", "Packets received from the client.", &client_metrics::recv_packets},
+        {"animatour_client_received_bytes_total", "Bytes received from the client.", &client_metrics::recv_bytes},
+        {"animatour_client_sent_packets_total", "Packets sent to the client.", &client_metrics::send_packets},
+        {"animatour_client_sent_bytes_total", "Bytes sent to the client.", &client_metrics::send_bytes},
+    };
+    for (const auto &counter : client_counters)
+    {
+        metric_header_render(out, std::get<0>(counter), "counter", std::get<1>(counter));
+        for (size_t i = 0; i < clients.size(); i++)
         {
-            update_grid_size();
-            crop_videobox(rows, cols, capsfilter);
+            metric_sample_render(out, std::get<0>(counter), client_labels[i], clients[i].*std::get<2>(counter));
         }
+    }
 
-        if (has_addition_occurred || has_removal_occurred)
+    metric_header_render(out, "animatour_client_loss_ratio", "gauge", "Packet loss reported by the client in its latest receiver report.");
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i].has_report)
+            metric_sample_render(out, "animatour_client_loss_ratio", client_labels[i], clients[i].report.loss_permille / 1000.0);
+    }
+    metric_header_render(out, "animatour_client_jitter_seconds", "gauge", "Interarrival jitter reported by the client in its latest receiver report.");
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i].has_report)
+            metric_sample_render(out, "animatour_client_jitter_seconds", client_labels[i], clients[i].report.jitter_ms / 1000.0);
+    }
+
+    return out;
+}
+
+void print_usage(char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-a] [-b] [-u] [-g] [-m maxsources] [-w workers] [-n shards] [-r renditions] [-c cellsize] [-o outputsize] [-x] [-F framerate] [-t threads] [-A] [-f fecpercentage] [-l minimal|smooth|adaptive] [-s] [-P pacingmultiple] [-T] [-L] [-M metricsport] [-p port]\n", program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    int server_port = 27884;
+    size_t core_count = std::max(1u, std::thread::hardware_concurrency());
+    // One worker per core by default
+    size_t worker_count = core_count;
+    // A single receive socket by default
+    size_t shard_count = 1;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "abugm:w:n:r:c:o:xF:t:Af:l:sP:TLM:p:h")) != -1)
+    {
+        switch (opt)
         {
-            std::cout << "---- Active clients ----" << std::endl;
-            for (const auto &client_sockaddr : client_sockaddrs)
+        case 'a':
+            is_in_process = true;
+            break;
+        case 'b':
+            is_batched = true;
+            break;
+        case 'u':
+            is_uring = true;
+            break;
+        case 'g':
+            is_gso = true;
+            break;
+        case 'm':
+            if (!parse_count(optarg, max_sources))
+            {
+                std::cerr << "Invalid maximum number of sources, expected a positive integer." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            if (!parse_count(optarg, worker_count))
+            {
+                std::cerr << "Invalid number of workers, expected a positive integer." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            if (!parse_count(optarg, shard_count))
+            {
+                std::cerr << "Invalid number of shards, expected a positive integer." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            if (!parse_renditions(optarg, rendition_specs))
             {
-                char client_ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &(client_sockaddr.sin_addr), client_ip, INET_ADDRSTRLEN);
-                std::cout << client_ip << ":" << ntohs(client_sockaddr.sin_port) << std::endl;
+                std::cerr << "Invalid renditions, expected bitrate[@scale],... with scale in (0, 1]." << std::endl;
+                exit(EXIT_FAILURE);
             }
-            std::cout << "------------------------" << std::endl;
+            break;
+        case 'c':
+            if (!parse_size(optarg, video_config.cell_width, video_config.cell_height))
+            {
+                std::cerr << "Invalid cell size, expected WxH with even dimensions." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            if (!parse_size(optarg, video_config.output_width, video_config.output_height))
+            {
+                std::cerr << "Invalid output size, expected WxH with even dimensions." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            is_fixed_output = true;
+            break;
+        case 'F':
+            video_config.framerate = std::clamp(atoi(optarg), 1, 255);
+            break;
+        case 't':
+            composite_threads = std::max(0, atoi(optarg));
+            break;
+        case 'A':
+            is_adaptive = true;
+            break;
+        case 'f':
+            fec_percentage = std::clamp(atoi(optarg), 0, 100);
+            break;
+        case 'l':
+            if (!jitterbuffer_mode_parse(optarg, source_jitterbuffer_mode))
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            is_sfu = true;
+            break;
+        case 'P':
+            pacing_multiple = std::max(0.0, atof(optarg));
+            break;
+        case 'T':
+            is_txtime = true;
+            break;
+        case 'L':
+            is_latency_measured = true;
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            break;
+        case 'p':
+            server_port = atoi(optarg);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    video_config.mode = is_sfu ? SERVER_MODE_SFU : SERVER_MODE_COMPOSITE;
+
+    if (is_uring)
+    {
+#ifdef HAVE_LIBURING
+        if (!uring_probe())
+        {
+            std::cerr << "The kernel does not support io_uring multishot receives, falling back to poll." << std::endl;
+            is_uring = false;
+        }
+#else
+        std::cerr << "Built without io_uring support, falling back to poll." << std::endl;
+        is_uring = false;
+#endif
+    }
+
+    // Initialize GStreamer
+    gst_init(nullptr, nullptr);
+
+    // Sockets for client to server and server to client (two-way) communication, one per shard
+    std::vector<std::unique_ptr<shard>> shards;
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        int sock = shard_sock_make(server_port, shard_count > 1);
+        if (sock < 0)
+            return 1;
+        shards.push_back(std::make_unique<shard>());
+        shards.back()->ix = i;
+        shards.back()->sock = sock;
+    }
+
+    // All shard sockets share the server port, so any of them can be used for sending
+    server_sock = shards.front()->sock;
+
+    // UDP_SEGMENT is known to the kernel from Linux 4.18
+    int segment_size = 0;
+    socklen_t segment_size_len = sizeof(segment_size);
+    if (is_gso && getsockopt(server_sock, SOL_UDP, UDP_SEGMENT, &segment_size, &segment_size_len) < 0)
+    {
+        std::cerr << "The kernel does not support UDP segmentation offload, falling back to sending packets one by one." << std::endl;
+        is_gso = false;
+    }
+
+    // Departure times are relative to CLOCK_MONOTONIC, which the fq qdisc of the egress interface enforces
+    sock_txtime txtime_config{CLOCK_MONOTONIC, 0};
+    if (is_txtime && (pacing_multiple == 0 || setsockopt(server_sock, SOL_SOCKET, SO_TXTIME, &txtime_config, sizeof(txtime_config)) < 0))
+    {
+        if (pacing_multiple > 0)
+        {
+            std::cerr << "The kernel does not support SO_TXTIME, falling back to pacing in the workers." << std::endl;
         }
+        is_txtime = false;
+    }
+
+    if (is_in_process)
+    {
+        init_appsrc_buffer_pool();
+    }
+
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        directory.workers.push_back(std::make_unique<worker>());
+        directory.workers.back()->ix = i;
+        directory.worker_room_counts.push_back(0);
+        worker_start(*directory.workers.back(), core_count);
+    }
+
+    // The workers are all started, so the metrics endpoint can read them
+    if (metrics_port != 0 && !metrics_serve(metrics_port, metrics_render))
+        return 1;
+
+    // The main thread runs the first shard
+    for (size_t i = 1; i < shard_count; i++)
+    {
+        shards[i]->thread = std::thread(shard_run, std::ref(*shards[i]));
+        shards[i]->thread.detach();
     }
+    shard_run(*shards.front());
 
-    close(server_sock);
-    close(udpsink_sock);
+    for (auto &s : shards)
+    {
+        close(s->sock);
+    }
 
-    return 0;
+    return 1;
 }